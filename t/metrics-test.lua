@@ -0,0 +1,66 @@
+local metrics = require "wtk.metrics.c"
+
+local registry = metrics.new()
+local requests = registry:counter("http_requests_total", "Requests handled.", { "method", "status" })
+requests:inc(1, "GET", 200)
+requests:inc(2, "GET", 200)
+requests:inc(1, "POST", 500)
+registry:counter("escaped_total", "Help on\ntwo lines.", { "path" }):inc(1, 'a"b\\c\nd')
+registry:gauge("temperature", "Current temperature."):set(21.5)
+local latency = registry:histogram("latency_seconds", "Request latency.", { "route" })
+for _, value in ipairs({ 0.003, 0.02, 0.02, 0.3, 7, 20 }) do latency:observe(value, "/") end
+
+-- families come out sorted by name, with their series sorted by labels; label values and help text are escaped.
+local expected = [[
+# HELP escaped_total Help on two lines.
+# TYPE escaped_total counter
+escaped_total{path="a\"b\\c\nd"} 1
+# HELP http_requests_total Requests handled.
+# TYPE http_requests_total counter
+http_requests_total{method="GET",status="200"} 3
+http_requests_total{method="POST",status="500"} 1
+# HELP latency_seconds Request latency.
+# TYPE latency_seconds histogram
+latency_seconds_bucket{route="/",le="0.005"} 1
+latency_seconds_bucket{route="/",le="0.01"} 1
+latency_seconds_bucket{route="/",le="0.025"} 3
+latency_seconds_bucket{route="/",le="0.05"} 3
+latency_seconds_bucket{route="/",le="0.1"} 3
+latency_seconds_bucket{route="/",le="0.25"} 3
+latency_seconds_bucket{route="/",le="0.5"} 4
+latency_seconds_bucket{route="/",le="1"} 4
+latency_seconds_bucket{route="/",le="2.5"} 4
+latency_seconds_bucket{route="/",le="5"} 4
+latency_seconds_bucket{route="/",le="10"} 5
+latency_seconds_bucket{route="/",le="+Inf"} 6
+latency_seconds_sum{route="/"} 27.343
+latency_seconds_count{route="/"} 6
+# HELP temperature Current temperature.
+# TYPE temperature gauge
+temperature 21.5
+]]
+local exposed = registry:expose()
+if exposed ~= expected then error("unexpected exposition:\n" .. exposed) end
+print("exposition ok")
+
+-- every line is a comment or a sample, and histogram buckets never go down.
+local previous
+for line in exposed:gmatch("[^\n]+") do
+  assert(line:find("^# HELP %S+ ") or line:find("^# TYPE %S+ %a+$") or line:find("^[%a_:][%w_:]*{?.*}? %-?[%d%.e%+]+$"), "malformed line: " .. line)
+  local count = line:match('_bucket{.*} (%d+)$')
+  if count then
+    assert(not previous or tonumber(count) >= previous, "bucket counts decreased: " .. line)
+    previous = line:find('le="%+Inf"') and nil or tonumber(count)
+  end
+end
+
+-- custom buckets, and a registry with nothing in it.
+local custom = metrics.new():histogram("sizes", nil, nil, { buckets = { 10, 100 } })
+custom:observe(5)
+custom:observe(50)
+custom:observe(500)
+local text = custom.registry:expose()
+assert(text:find('sizes_bucket{le="10"} 1\n', 1, true) and text:find('sizes_bucket{le="100"} 2\n', 1, true) and text:find('sizes_bucket{le="+Inf"} 3\n', 1, true))
+assert(not text:find("# HELP"), "a family without help shouldn't get a HELP line")
+assert(metrics.new():expose() == "")
+print("buckets ok")
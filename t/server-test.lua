@@ -0,0 +1,57 @@
+local driver = require "wtk.server.c"
+
+-- websocket frames are final, unmasked, and use the shortest length encoding that fits.
+local ws = driver.websocket
+assert(ws.frame("hello") == "\x81\x05hello")
+assert(ws.frame("", 0x9) == "\x89\x00")
+assert(ws.frame("bye", 0x8) == "\x88\x03bye")
+for _, length in ipairs({ 125, 126, 65535, 65536, 200000 }) do
+  local message = string.rep("x", length)
+  local frame = ws.frame(message, 0x2)
+  assert(frame:byte(1) == 0x82)
+  local header
+  if length <= 125 then
+    header = 2
+    assert(frame:byte(2) == length)
+  elseif length <= 65535 then
+    header = 4
+    assert(frame:byte(2) == 126 and string.unpack(">I2", frame, 3) == length)
+  else
+    header = 10
+    assert(frame:byte(2) == 127 and string.unpack(">I8", frame, 3) == length)
+  end
+  assert(#frame == header + length and frame:sub(header + 1) == message, "bad frame for " .. length .. " bytes")
+end
+print("websocket frames ok")
+
+-- server-sent events put each line of a multi-line value in its own field, and end with a blank line.
+local sse = driver.sse
+assert(sse.frame("hello") == "data: hello\n\n")
+assert(sse.frame("hello\nworld", "greeting", "1") == "event: greeting\nid: 1\ndata: hello\ndata: world\n\n")
+assert(sse.frame("a\r\nb\rc", nil, nil, 5000) == "retry: 5000\ndata: a\ndata: b\ndata: c\n\n")
+assert(sse.frame(nil, "ping") == "event: ping\n\n")
+assert(sse.comment() == ": \n\n")
+assert(sse.comment("keep-alive") == ": keep-alive\n\n")
+assert(sse.comment("two\nlines") == ": two\n: lines\n\n")
+print("event stream frames ok")
+
+-- base64, checked against known vectors, and round tripped with and without padding.
+local base64 = driver.base64
+local vectors = { [""] = "", f = "Zg==", fo = "Zm8=", foo = "Zm9v", foob = "Zm9vYg==", fooba = "Zm9vYmE=", foobar = "Zm9vYmFy" }
+for plain, encoded in pairs(vectors) do
+  assert(base64.encode(plain) == encoded, "encoding " .. plain)
+  assert(base64.decode(encoded) == plain, "decoding " .. encoded)
+  assert(base64.decode((encoded:gsub("=", ""))) == plain, "decoding unpadded " .. encoded)
+end
+local bytes = { }
+for i = 0, 255 do bytes[#bytes + 1] = string.char(i) end
+bytes = table.concat(bytes)
+for length = 0, #bytes do
+  local input = bytes:sub(1, length)
+  local encoded = base64.encode(input)
+  assert(#encoded == math.ceil(length / 3) * 4 and not encoded:find("[^%w%+/=]"))
+  assert(base64.decode(encoded) == input, "round trip of " .. length .. " bytes")
+end
+-- the handshake from RFC 6455.
+assert(base64.encode(driver.sha1.binary("dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=")
+print("base64 ok")
@@ -0,0 +1,47 @@
+-- Packed files are views rather than strings, so this has to run from a binary packed with this directory's
+-- view-test.txt; from here, something like `packer view-test.lua view-test.txt init.lua`, where init.lua requires
+-- "view-test". Packing with --gzip checks the gzipped copy as well.
+local view = assert(packed and packed["view-test.txt"], "run this from a binary packed with view-test.txt")
+local f = assert(io.open("view-test.txt", "rb"), "run this from the t directory")
+local expected = f:read("a")
+f:close()
+
+assert(type(view) == "userdata", "packed files should be views")
+assert(#view == #expected)
+assert(tostring(view) == expected)
+assert(view.etag and view.etag:find('^".+"$'), "packed files should have a quoted etag")
+
+-- `sub` and `slice` take the same arguments as string.sub, including negative and out of range indices.
+local indices = { -100, -#expected - 1, -#expected, -5, -1, 0, 1, 2, 10, #expected - 1, #expected, #expected + 1, 100 }
+for _, i in ipairs(indices) do
+  assert(view:sub(i) == expected:sub(i), "sub(" .. i .. ")")
+  assert(tostring(view:slice(i)) == expected:sub(i), "slice(" .. i .. ")")
+  for _, j in ipairs(indices) do
+    local want = expected:sub(i, j)
+    assert(view:sub(i, j) == want, "sub(" .. i .. ", " .. j .. ")")
+    local slice = view:slice(i, j)
+    assert(#slice == #want and tostring(slice) == want, "slice(" .. i .. ", " .. j .. ")")
+  end
+end
+assert(view:sub() == expected and tostring(view:slice()) == expected)
+
+-- slices are views too, and can be sliced in turn; they don't carry the file's attributes.
+local middle = view:slice(5, -5)
+assert(type(middle) == "userdata" and middle.etag == nil)
+assert(tostring(middle:slice(3, 7)) == expected:sub(5, -5):sub(3, 7))
+assert(middle:sub(-3) == expected:sub(5, -5):sub(-3))
+
+-- concatenating copies a view out, on either side, next to strings, numbers or other views.
+assert(view .. "!" == expected .. "!")
+assert("<" .. view == "<" .. expected)
+assert(view .. 1 == expected .. 1 and 2 .. view == 2 .. expected)
+assert(view .. middle == expected .. expected:sub(5, -5))
+assert("[" .. middle .. "]" == "[" .. expected:sub(5, -5) .. "]")
+local ok, err = pcall(function() return view .. {} end)
+assert(not ok and err:find("attempt to concatenate a table value"))
+
+if view.gzip then
+  assert(type(view.gzip) == "userdata" and view.gzip:sub(1, 2) == "\x1f\x8b")
+  print("gzipped copy present")
+end
+print("views ok")
@@ -0,0 +1,50 @@
+local z = require "wtk.z.c"
+
+-- Compresses `input` through z:open("gzip"), sending it in `chunk`-sized pieces.
+local function gzip(input, chunk, level)
+  local stream = z:open("gzip", { level = level })
+  local parts = { }
+  for i = 1, #input, chunk do table.insert(parts, assert(stream:send(input, i, chunk))) end
+  table.insert(parts, assert(stream:close()))
+  return table.concat(parts)
+end
+
+-- Decompresses with the system's gzip, so the framing is checked against something other than itself.
+local function gunzip(compressed)
+  local source, target = os.tmpname(), os.tmpname()
+  local f = assert(io.open(source, "wb"))
+  f:write(compressed)
+  f:close()
+  assert(os.execute(string.format("gzip -dc < %s > %s", source, target)), "gzip couldn't decompress the stream")
+  f = assert(io.open(target, "rb"))
+  local output = f:read("a")
+  f:close()
+  os.remove(source)
+  os.remove(target)
+  return output
+end
+
+local random = { }
+for i = 1, 200000 do random[i] = string.char(math.random(0, 255)) end
+local inputs = {
+  empty = "",
+  short = "hello, world",
+  repetitive = string.rep("The quick brown fox jumps over the lazy dog. ", 5000),
+  random = table.concat(random)
+}
+
+for name, input in pairs(inputs) do
+  for _, chunk in ipairs({ 1000, 8192, 100000 }) do
+    local compressed = gzip(input, chunk, 6)
+    assert(compressed:sub(1, 3) == "\x1f\x8b\x08", name .. ": missing gzip header")
+    local crc, size = string.unpack("<I4I4", compressed, #compressed - 7)
+    assert(size == #input % 2^32, name .. ": wrong size in trailer")
+    assert(gunzip(compressed) == input, name .. ": round trip doesn't match")
+    if name == "repetitive" then assert(#compressed < #input / 50, "repetitive input should compress well") end
+    print(string.format("%-10s chunk %6d: %7d -> %7d bytes, crc %08x", name, chunk, #input, #compressed, crc))
+  end
+end
+
+-- the one-shot helper frames its output the same way.
+assert(gunzip(z.gzip(inputs.repetitive, { yield = true })) == inputs.repetitive)
+print("All gzip round trips matched.")
@@ -8,7 +8,7 @@
 #endif
 
 int main(int argc, char* argv[]) {
-  lua_State* L = luaL_newstate();
+  lua_State* L = luaW_newstate();
   luaL_openlibs(L);
   luaW_requiref(L, "wtk.server.c", luaopen_wtk_server_c);
   luaW_requiref(L, "wtk.client.c", luaopen_wtk_client_c);
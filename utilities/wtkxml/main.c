@@ -6,7 +6,7 @@
 #endif
 
 int main(int argc, char* argv[]) {
-  lua_State* L = luaL_newstate();
+  lua_State* L = luaW_newstate();
   luaL_openlibs(L);
   lua_pushliteral(L, WTKXML_VERSION), lua_setglobal(L, "VERSION");
   luaL_requiref(L, "wtk.c", luaopen_wtk_c, 0);
@@ -11284,6 +11284,19 @@ static int socket_yield(lua_State* L, int fd, const char* type, lua_KFunction k)
   lua_yieldk(L, 1, 0, k);
 }
 
+// If the job this coroutine is running was cancelled with wtk.Loop:cancel, pushes what it was cancelled with; from wtk.c.
+int luaW_iscancelled(lua_State* L);
+
+static int f_client_socket_close(lua_State* L);
+
+// Called by a continuation that finds its job cancelled; closes the socket, so the connection isn't left half-used, and raises.
+static int socket_cancel(lua_State* L) {
+  int reason = lua_gettop(L);
+  f_client_socket_close(L);
+  lua_pushvalue(L, reason);
+  return lua_error(L);
+}
+
 static int socket_set_blocking(client_socket_t* c, int blocking) {
   if (blocking != c->blocking) {
     c->blocking = blocking;
@@ -11307,6 +11320,8 @@ static int socket_set_blocking(client_socket_t* c, int blocking) {
 }
 
 static int f_client_socket_recvk(lua_State* L, int status, lua_KContext ctx) {
+  if (status == LUA_YIELD && luaW_iscancelled(L))
+    return socket_cancel(L);
   lua_getfield(L, 1, "__c");
   client_socket_t* socket = lua_touserdata(L, -1);
   lua_pop(L, 1);
@@ -11351,6 +11366,8 @@ static int f_client_socket_recvk(lua_State* L, int status, lua_KContext ctx) {
 static int f_client_socket_recv(lua_State* L) { return f_client_socket_recvk(L, 0, 0); }
 
 static int f_client_socket_sendk(lua_State* L, int status, lua_KContext ctx) {
+  if (status == LUA_YIELD && luaW_iscancelled(L))
+    return socket_cancel(L);
   lua_getfield(L, 1, "__c");
   client_socket_t* socket = lua_touserdata(L, -1);
   size_t len;
@@ -11381,6 +11398,8 @@ static int f_client_socket_send(lua_State* L) { return f_client_socket_sendk(L,
 
 
 static int f_client_socket_openk(lua_State* L, int status, lua_KContext ctx) {
+  if (status == LUA_YIELD && luaW_iscancelled(L))
+    return socket_cancel(L);
   lua_getfield(L, 1, "__c");
   client_socket_t* c = lua_touserdata(L, -1);
   const char* protocol = luaL_checkstring(L, 2);
@@ -45,6 +45,31 @@ static int lua_iscoroutine(lua_State* L) {
   return is_coroutine;
 }
 
+// If the job this coroutine is running was cancelled with wtk.Loop:cancel, pushes what it was cancelled with; from wtk.c.
+int luaW_iscancelled(lua_State* L);
+
+// Called by a continuation that finds its job cancelled mid-query. The nonblocking API has no way to abandon a query
+// part way through, so the connection is closed, and the reason raised. The connection goes first, so that freeing an
+// unbuffered result doesn't try to read the rest of its rows.
+static int mysql_cancel(lua_State* L, mysql_t* mysql, mysql_result_t* result) {
+  if (mysql->db) {
+    mysql_close(mysql->db);
+    mysql->db = NULL;
+  }
+  if (result && result->result) {
+    mysql_free_result(result->result);
+    result->result = NULL;
+  }
+  return lua_error(L);
+}
+
+// The connection is gone once it's closed, or a query on it has been cancelled.
+static int mysql_closed(lua_State* L) {
+  lua_pushnil(L);
+  lua_pushliteral(L, "connection closed");
+  return 2;
+}
+
 static mysql_result_t* lua_tomysql_result(lua_State* L, int index) {
   return (mysql_result_t*)lua_touserdata(L, index);
 }
@@ -125,6 +150,8 @@ static int f_mysql_result_fetchk(lua_State* L, int state, lua_KContext ctx) {
   mysql_result_t* mysql_result = lua_tomysql_result(L, 1);
   if (!mysql_result->result)
     return 0;
+  if (state == LUA_YIELD && luaW_iscancelled(L))
+    return mysql_cancel(L, mysql_result->mysql, mysql_result);
   mysql_result_fetch_status_e status = ctx;
   switch (status) {
     case MYSQL_RESULT_FETCH_STATUS_FETCHING: {
@@ -237,6 +264,9 @@ static int f_mysql_connect(lua_State* L) {
 
 
 static int f_mysql_quote(lua_State* L) {
+  mysql_t* mysql = lua_tomysql(L, 1);
+  if (mysql && !mysql->db)
+    return mysql_closed(L);
   luaL_gsub(L, luaL_gsub(L, luaL_checkstring(L, 2), "\\", "\\\\"), "\"", "\\\"");
   lua_pushliteral(L, "\"");
   lua_pushvalue(L, -2);
@@ -247,6 +277,8 @@ static int f_mysql_quote(lua_State* L) {
 
 static int f_mysql_escape(lua_State* L) {
   mysql_t* mysql = lua_tomysql(L, 1);
+  if (!mysql->db)
+    return mysql_closed(L);
   size_t from_length;
   const char* from = luaL_checklstring(L, 2, &from_length);
   size_t to_max_length = from_length*2 + 1;
@@ -282,6 +314,10 @@ typedef enum {
 
 static int f_mysql_queryk(lua_State* L, int state, lua_KContext ctx) {
   mysql_t* mysql = lua_tomysql(L, 1);
+  if (state == LUA_YIELD && luaW_iscancelled(L))
+    return mysql_cancel(L, mysql, NULL);
+  if (!mysql->db)
+    return mysql_closed(L);
   size_t statement_length;
   const char* statement = luaL_checklstring(L, 2, &statement_length);
   switch (ctx) {
@@ -365,6 +401,8 @@ static int f_mysql_txn_start(lua_State* L) {
 
 static int f_mysql_txn_commit(lua_State* L) {
   mysql_t* mysql = lua_tomysql(L, 1);
+  if (!mysql->db)
+    return mysql_closed(L);
   if (mysql_commit(mysql->db)) {
     lua_pushnil(L);
     lua_pushstring(L, mysql_error(mysql->db));
@@ -376,6 +414,8 @@ static int f_mysql_txn_commit(lua_State* L) {
 
 static int f_mysql_txn_rollback(lua_State *L) {
   mysql_t* mysql = lua_tomysql(L, 1);
+  if (!mysql->db)
+    return mysql_closed(L);
   if (mysql_rollback(mysql->db)) {
     lua_pushnil(L);
     lua_pushstring(L, mysql_error(mysql->db));
@@ -38,6 +38,23 @@ static int lua_iscoroutine(lua_State* L) {
   return is_coroutine;
 }
 
+// If the job this coroutine is running was cancelled with wtk.Loop:cancel, pushes what it was cancelled with; from wtk.c.
+int luaW_iscancelled(lua_State* L);
+
+// Called by a continuation that finds its job cancelled mid-query. The results still on their way would have to be read
+// before the connection could be used again, so rather than wait for them, the connection is closed, and the reason raised.
+static int postgres_cancel(lua_State* L, postgres_t* postgres, postgres_result_t* result) {
+  if (result && result->result) {
+    PQclear(result->result);
+    result->result = NULL;
+  }
+  if (postgres->db) {
+    PQfinish(postgres->db);
+    postgres->db = NULL;
+  }
+  return lua_error(L);
+}
+
 static postgres_result_t* lua_topostgres_result(lua_State* L, int index) {
   return (postgres_result_t*)lua_touserdata(L, index);
 }
@@ -94,6 +111,8 @@ static int postgres_get_result(postgres_result_t* result, int nonblocking) {
 
 static int f_postgres_result_fetchk(lua_State* L, int state, lua_KContext ctx) {
   postgres_result_t* postgres_result = lua_topostgres_result(L, 1);
+  if (state == LUA_YIELD && luaW_iscancelled(L))
+    return postgres_cancel(L, postgres_result->postgres, postgres_result);
   if (postgres_result->result && postgres_result->current_row >= postgres_result->rows) {
     int status = postgres_get_result(postgres_result, postgres_result->postgres->nonblocking && lua_iscoroutine(L));
     if (status == LUA_YIELD) {
@@ -303,10 +322,18 @@ typedef enum {
 
 static int f_postgres_queryk(lua_State* L, int state, lua_KContext ctx) {
   postgres_t* postgres = lua_topostgres(L, 1);
+  if (state == LUA_YIELD && luaW_iscancelled(L))
+    return postgres_cancel(L, postgres, lua_topostgres_result(L, 3));
   switch (ctx) {
     case QUERY_INIT: {
       size_t statement_length;
       const char* statement = luaL_checklstring(L, 2, &statement_length);
+      lua_settop(L, 2);
+      if (!postgres->db) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "connection closed");
+        return 2;
+      }
       if (PQsendQuery(postgres->db, statement) == 0) {
         lua_pushnil(L);
         lua_pushstring(L, PQerrorMessage(postgres->db));
@@ -322,7 +349,8 @@ static int f_postgres_queryk(lua_State* L, int state, lua_KContext ctx) {
       lua_setmetatable(L, -2);
     } // deliberate fallthrough
     case QUERY_WAITING: {
-      postgres_result_t* result = lua_touserdata(L, -1);
+      // the result is always third; whatever resumed us leaves its arguments on top of the stack.
+      postgres_result_t* result = lua_topostgres_result(L, 3);
       int status = postgres_get_result(result, postgres->nonblocking && lua_iscoroutine(L)); // get first result
       if (status == LUA_YIELD) {
         return lua_yieldpostgres(L, postgres, QUERY_WAITING, f_postgres_queryk);
@@ -0,0 +1,414 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include <sys/mman.h>
+
+int luaW_loadblock(lua_State* L, const char* name, int line, const char* str);
+
+// Every series lives in a single anonymous shared mapping, so that a registry created before forking is updated, and
+// read, by every worker. Series are found by name in an open-addressed table at the front of the mapping, and their
+// values are allocated from the cells after it; both are only ever touched atomically, so no locks are needed.
+#define METRICS_NAME_LENGTH 104
+// Histograms are log-linear; each power of two is split into 8 linear sub-buckets, so values are within 12.5%.
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * (64 - METRICS_SUB_BUCKET_BITS + 1))
+
+typedef enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM } metric_type_e;
+typedef enum { SLOT_EMPTY, SLOT_CLAIMING, SLOT_READY, SLOT_FULL } metric_slot_state_e;
+static const char* metric_types[] = { "counter", "gauge", "histogram", NULL };
+
+typedef struct {
+    uint32_t state;
+    uint32_t type;
+    uint32_t cell;
+    uint32_t unused;
+    double resolution;
+    char name[METRICS_NAME_LENGTH];
+} metric_slot_t;
+
+typedef struct {
+    uint32_t slots;
+    uint32_t cells;
+    uint32_t next_cell;
+    uint32_t unused;
+} metrics_header_t;
+
+typedef struct {
+    metrics_header_t* header;
+    metric_slot_t* slots;
+    int64_t* cells;
+    size_t size;
+} metrics_t;
+
+typedef struct {
+    int64_t* cells;
+    int type;
+    double resolution;
+} metric_series_t;
+
+static int metric_cell_count(int type) { return type == METRIC_HISTOGRAM ? 2 + METRICS_BUCKETS : 1; }
+
+static int metric_bucket(uint64_t ticks) {
+    if (ticks < METRICS_SUB_BUCKETS)
+        return ticks;
+    int shift = 63 - __builtin_clzll(ticks) - METRICS_SUB_BUCKET_BITS;
+    return METRICS_SUB_BUCKETS + shift * METRICS_SUB_BUCKETS + (int)((ticks >> shift) - METRICS_SUB_BUCKETS);
+}
+
+// The lowest and highest number of ticks that end up in a bucket.
+static void metric_bucket_range(int bucket, uint64_t* low, uint64_t* high) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        *low = *high = bucket;
+        return;
+    }
+    int shift = (bucket - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS;
+    uint64_t mantissa = METRICS_SUB_BUCKETS + (bucket - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+    *low = mantissa << shift;
+    *high = ((mantissa + 1) << shift) - 1;
+}
+
+static double metric_load_double(int64_t* cell) {
+    int64_t bits = __atomic_load_n(cell, __ATOMIC_RELAXED);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void metric_add_double(int64_t* cell, double delta) {
+    int64_t expected = __atomic_load_n(cell, __ATOMIC_RELAXED), desired;
+    do {
+        double value;
+        memcpy(&value, &expected, sizeof(value));
+        value += delta;
+        memcpy(&desired, &value, sizeof(desired));
+    } while (!__atomic_compare_exchange_n(cell, &expected, desired, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint32_t metric_hash(const char* name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+}
+
+
+// Argument 1 is the maximum number of series, argument 2 the number of 8-byte cells to hold their values.
+static int f_metrics_new(lua_State* L) {
+    uint32_t slots = luaL_optinteger(L, 1, 1024);
+    uint32_t cells = luaL_optinteger(L, 2, 256*1024);
+    size_t size = sizeof(metrics_header_t) + slots * sizeof(metric_slot_t) + (size_t)cells * sizeof(int64_t);
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "unable to map metrics region: %s", strerror(errno));
+        return 2;
+    }
+    metrics_t* metrics = lua_newuserdata(L, sizeof(metrics_t));
+    metrics->header = region;
+    metrics->header->slots = slots;
+    metrics->header->cells = cells;
+    metrics->slots = (metric_slot_t*)&metrics->header[1];
+    metrics->cells = (int64_t*)&metrics->slots[slots];
+    metrics->size = size;
+    luaL_setmetatable(L, "wtk.metrics.c");
+    return 1;
+}
+
+static int f_metrics_gc(lua_State* L) {
+    metrics_t* metrics = luaL_checkudata(L, 1, "wtk.metrics.c");
+    if (metrics->header)
+        munmap(metrics->header, metrics->size);
+    metrics->header = NULL;
+    return 0;
+}
+
+// Finds, or allocates, the series with the full name (including labels) given.
+static int f_metrics_series(lua_State* L) {
+    metrics_t* metrics = luaL_checkudata(L, 1, "wtk.metrics.c");
+    size_t length;
+    const char* name = luaL_checklstring(L, 2, &length);
+    int type = luaL_checkoption(L, 3, NULL, metric_types);
+    double resolution = luaL_optnumber(L, 4, 1e-6);
+    if (length >= METRICS_NAME_LENGTH)
+        return luaL_error(L, "metric name too long: %s", name);
+    uint32_t hash = metric_hash(name, length);
+    metric_slot_t* slot = NULL;
+    for (uint32_t i = 0; i < metrics->header->slots && !slot; ++i) {
+        metric_slot_t* candidate = &metrics->slots[(hash + i) % metrics->header->slots];
+        uint32_t state = __atomic_load_n(&candidate->state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_EMPTY && __atomic_compare_exchange_n(&candidate->state, &state, SLOT_CLAIMING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            uint32_t count = metric_cell_count(type);
+            uint32_t cell = __atomic_fetch_add(&metrics->header->next_cell, count, __ATOMIC_ACQ_REL);
+            memcpy(candidate->name, name, length + 1);
+            candidate->type = type;
+            candidate->cell = cell;
+            candidate->resolution = resolution;
+            __atomic_store_n(&candidate->state, cell + count > metrics->header->cells ? SLOT_FULL : SLOT_READY, __ATOMIC_RELEASE);
+            slot = candidate;
+            break;
+        }
+        // someone else is in the middle of claiming this slot; it could be for our name.
+        while (state == SLOT_CLAIMING) {
+            sched_yield();
+            state = __atomic_load_n(&candidate->state, __ATOMIC_ACQUIRE);
+        }
+        if (strcmp(candidate->name, name) == 0)
+            slot = candidate;
+    }
+    if (!slot || slot->state == SLOT_FULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "metrics region full");
+        return 2;
+    }
+    if (slot->type != (uint32_t)type)
+        return luaL_error(L, "metric %s already registered as a %s", name, metric_types[slot->type]);
+    metric_series_t* series = lua_newuserdatauv(L, sizeof(metric_series_t), 1);
+    series->cells = &metrics->cells[slot->cell];
+    series->type = slot->type;
+    series->resolution = slot->resolution;
+    // keep the mapping alive for as long as any series is.
+    lua_pushvalue(L, 1);
+    lua_setiuservalue(L, -2, 1);
+    luaL_setmetatable(L, "wtk.metrics.c.series");
+    return 1;
+}
+
+static void metrics_push_buckets(lua_State* L, int64_t* cells, double resolution) {
+    lua_newtable(L);
+    for (int i = 0; i < METRICS_BUCKETS; ++i) {
+        int64_t count = __atomic_load_n(&cells[2 + i], __ATOMIC_RELAXED);
+        if (count > 0) {
+            uint64_t low, high;
+            metric_bucket_range(i, &low, &high);
+            lua_createtable(L, 2, 0);
+            lua_pushnumber(L, high * resolution);
+            lua_rawseti(L, -2, 1);
+            lua_pushinteger(L, count);
+            lua_rawseti(L, -2, 2);
+            lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+        }
+    }
+}
+
+// Returns every series in the region, whichever process created it, as { name, type, value } for counters and gauges,
+// and { name, "histogram", count, sum, { { upper bound, count }, ... } } for histograms.
+static int f_metrics_collect(lua_State* L) {
+    metrics_t* metrics = luaL_checkudata(L, 1, "wtk.metrics.c");
+    lua_newtable(L);
+    for (uint32_t i = 0; i < metrics->header->slots; ++i) {
+        metric_slot_t* slot = &metrics->slots[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_READY)
+            continue;
+        int64_t* cells = &metrics->cells[slot->cell];
+        lua_createtable(L, 5, 0);
+        lua_pushstring(L, slot->name);
+        lua_rawseti(L, -2, 1);
+        lua_pushstring(L, metric_types[slot->type]);
+        lua_rawseti(L, -2, 2);
+        switch (slot->type) {
+            case METRIC_COUNTER: lua_pushinteger(L, __atomic_load_n(&cells[0], __ATOMIC_RELAXED)); break;
+            case METRIC_GAUGE: lua_pushnumber(L, metric_load_double(&cells[0])); break;
+            case METRIC_HISTOGRAM:
+                lua_pushnumber(L, __atomic_load_n(&cells[1], __ATOMIC_RELAXED) * slot->resolution);
+                lua_rawseti(L, -2, 4);
+                metrics_push_buckets(L, cells, slot->resolution);
+                lua_rawseti(L, -2, 5);
+                lua_pushinteger(L, __atomic_load_n(&cells[0], __ATOMIC_RELAXED));
+            break;
+        }
+        lua_rawseti(L, -2, 3);
+        lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+    }
+    return 1;
+}
+
+static const luaL_Reg f_metrics_api[] = {
+    { "__gc",      f_metrics_gc       },
+    { "__new",     f_metrics_new      },
+    { "series",    f_metrics_series   },
+    { "collect",   f_metrics_collect  },
+    { NULL,        NULL               }
+};
+
+
+// Counters take integers, gauges take numbers, and add to themselves.
+static int f_series_inc(lua_State* L) {
+    metric_series_t* series = luaL_checkudata(L, 1, "wtk.metrics.c.series");
+    if (series->type == METRIC_GAUGE)
+        metric_add_double(series->cells, luaL_optnumber(L, 2, 1));
+    else
+        __atomic_fetch_add(series->cells, luaL_optinteger(L, 2, 1), __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int f_series_dec(lua_State* L) {
+    metric_series_t* series = luaL_checkudata(L, 1, "wtk.metrics.c.series");
+    luaL_argcheck(L, series->type == METRIC_GAUGE, 1, "only gauges can be decremented");
+    metric_add_double(series->cells, -luaL_optnumber(L, 2, 1));
+    return 0;
+}
+
+static int f_series_set(lua_State* L) {
+    metric_series_t* series = luaL_checkudata(L, 1, "wtk.metrics.c.series");
+    luaL_argcheck(L, series->type == METRIC_GAUGE, 1, "only gauges can be set");
+    double value = luaL_checknumber(L, 2);
+    int64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    __atomic_store_n(series->cells, bits, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int f_series_observe(lua_State* L) {
+    metric_series_t* series = luaL_checkudata(L, 1, "wtk.metrics.c.series");
+    luaL_argcheck(L, series->type == METRIC_HISTOGRAM, 1, "only histograms can observe");
+    double value = luaL_checknumber(L, 2) / series->resolution;
+    uint64_t ticks = value > 0 ? (value < 9.2e18 ? (uint64_t)value : INT64_MAX) : 0;
+    __atomic_fetch_add(&series->cells[0], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&series->cells[1], (int64_t)ticks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&series->cells[2 + metric_bucket(ticks)], 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// For histograms, returns the count and sum of all observations.
+static int f_series_get(lua_State* L) {
+    metric_series_t* series = luaL_checkudata(L, 1, "wtk.metrics.c.series");
+    switch (series->type) {
+        case METRIC_COUNTER: lua_pushinteger(L, __atomic_load_n(series->cells, __ATOMIC_RELAXED)); return 1;
+        case METRIC_GAUGE: lua_pushnumber(L, metric_load_double(series->cells)); return 1;
+    }
+    lua_pushinteger(L, __atomic_load_n(&series->cells[0], __ATOMIC_RELAXED));
+    lua_pushnumber(L, __atomic_load_n(&series->cells[1], __ATOMIC_RELAXED) * series->resolution);
+    return 2;
+}
+
+// Approximates a quantile from the histogram's buckets; returns the midpoint of the bucket the quantile falls in.
+static int f_series_quantile(lua_State* L) {
+    metric_series_t* series = luaL_checkudata(L, 1, "wtk.metrics.c.series");
+    luaL_argcheck(L, series->type == METRIC_HISTOGRAM, 1, "only histograms have quantiles");
+    double quantile = luaL_checknumber(L, 2);
+    int64_t count = __atomic_load_n(&series->cells[0], __ATOMIC_RELAXED), seen = 0;
+    if (count == 0)
+        return 0;
+    int64_t target = quantile * count < 1 ? 1 : (int64_t)(quantile * count + 0.5);
+    for (int i = 0; i < METRICS_BUCKETS; ++i) {
+        seen += __atomic_load_n(&series->cells[2 + i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            uint64_t low, high;
+            metric_bucket_range(i, &low, &high);
+            lua_pushnumber(L, (low + high) / 2.0 * series->resolution);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const luaL_Reg f_series_api[] = {
+    { "inc",       f_series_inc       },
+    { "dec",       f_series_dec       },
+    { "set",       f_series_set       },
+    { "observe",   f_series_observe   },
+    { "get",       f_series_get       },
+    { "quantile",  f_series_quantile  },
+    { NULL,        NULL               }
+};
+
+int luaopen_wtk_metrics_c(lua_State* L) {
+    luaL_newmetatable(L, "wtk.metrics.c.series");
+    luaL_setfuncs(L, f_series_api, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    luaL_newmetatable(L, "wtk.metrics.c");
+    luaL_setfuncs(L, f_metrics_api, 0);
+    if (luaW_loadblock(L, __FILE__, __LINE__, "\n\
+    local metrics = ...\n\
+    metrics.__index = metrics\n\
+    metrics.buckets = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 }\n\
+    local Family = { }\n\
+    Family.__index = Family\n\
+    local function escape(value) return (tostring(value):gsub('[\\\\\"\\n]', { ['\\\\'] = '\\\\\\\\', ['\"'] = '\\\\\"', ['\\n'] = '\\\\n' })) end\n\
+    -- Returns the series for a particular set of label values; these are cached, so this is cheap to call per request.\n\
+    function Family:labels(...)\n\
+        local node = self.cache\n\
+        for i = 1, #self.label_names do\n\
+            local value = select(i, ...)\n\
+            if value == nil then value = '' end\n\
+            local child = node[value]\n\
+            if not child then child = { } node[value] = child end\n\
+            node = child\n\
+        end\n\
+        if node.series then return node.series end\n\
+        local name = self.name\n\
+        if #self.label_names > 0 then\n\
+            local labels = { }\n\
+            for i, label in ipairs(self.label_names) do labels[i] = label .. '=\"' .. escape(select(i, ...) or '') .. '\"' end\n\
+            name = name .. '{' .. table.concat(labels, ',') .. '}'\n\
+        end\n\
+        node.series = assert(self.registry:series(name, self.type, self.resolution))\n\
+        return node.series\n\
+    end\n\
+    function Family:inc(n, ...) return self:labels(...):inc(n) end\n\
+    function Family:dec(n, ...) return self:labels(...):dec(n) end\n\
+    function Family:set(value, ...) return self:labels(...):set(value) end\n\
+    function Family:observe(value, ...) return self:labels(...):observe(value) end\n\
+    function metrics.new(options)\n\
+        options = options or { }\n\
+        return assert(metrics.__new(options.slots, options.cells))\n\
+    end\n\
+    function metrics:family(type, name, help, label_names, options)\n\
+        local families = metrics.families[self]\n\
+        if not families then families = { } metrics.families[self] = families end\n\
+        if families[name] then return families[name] end\n\
+        families[name] = setmetatable({ registry = self, type = type, name = name, help = help, label_names = label_names or { }, cache = { },\n\
+            resolution = options and options.resolution, buckets = options and options.buckets or metrics.buckets }, Family)\n\
+        return families[name]\n\
+    end\n\
+    function metrics:counter(name, help, label_names) return self:family('counter', name, help, label_names) end\n\
+    function metrics:gauge(name, help, label_names) return self:family('gauge', name, help, label_names) end\n\
+    function metrics:histogram(name, help, label_names, options) return self:family('histogram', name, help, label_names, options) end\n\
+    -- Renders every series in the registry, from every process sharing it, in the Prometheus text exposition format.\n\
+    function metrics:expose()\n\
+        local families, lines, grouped, order = metrics.families[self] or { }, { }, { }, { }\n\
+        for _, entry in ipairs(self:collect()) do\n\
+            local name, labels = entry[1]:match('^([^{]+)(.*)$')\n\
+            if not grouped[name] then grouped[name] = { } table.insert(order, name) end\n\
+            table.insert(grouped[name], { labels, entry })\n\
+        end\n\
+        table.sort(order)\n\
+        for _, name in ipairs(order) do\n\
+            local family, series = families[name], grouped[name]\n\
+            table.sort(series, function(a, b) return a[1] < b[1] end)\n\
+            if family and family.help then table.insert(lines, '# HELP ' .. name .. ' ' .. family.help:gsub('\\n', ' ')) end\n\
+            table.insert(lines, '# TYPE ' .. name .. ' ' .. series[1][2][2])\n\
+            for _, pair in ipairs(series) do\n\
+                local labels, entry = pair[1], pair[2]\n\
+                if entry[2] == 'histogram' then\n\
+                    local prefix = labels == '' and '{' or (labels:sub(1, -2) .. ',')\n\
+                    local cumulative, index, fine = 0, 1, entry[5]\n\
+                    for _, bound in ipairs(family and family.buckets or metrics.buckets) do\n\
+                        while fine[index] and fine[index][1] <= bound do cumulative, index = cumulative + fine[index][2], index + 1 end\n\
+                        table.insert(lines, string.format('%s_bucket%sle=\"%s\"} %d', name, prefix, bound, cumulative))\n\
+                    end\n\
+                    table.insert(lines, string.format('%s_bucket%sle=\"+Inf\"} %d', name, prefix, entry[3]))\n\
+                    table.insert(lines, string.format('%s_sum%s %.10g', name, labels, entry[4]))\n\
+                    table.insert(lines, string.format('%s_count%s %d', name, labels, entry[3]))\n\
+                else\n\
+                    table.insert(lines, string.format(math.type(entry[3]) == 'integer' and '%s%s %d' or '%s%s %.10g', name, labels, entry[3]))\n\
+                end\n\
+            end\n\
+        end\n\
+        table.insert(lines, '')\n\
+        return table.concat(lines, '\\n')\n\
+    end\n\
+    metrics.families = setmetatable({ }, { __mode = 'k' })\n\
+    return metrics"))
+        return lua_error(L);
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 1);
+    return 1;
+}
@@ -9,64 +9,254 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 int f_stream_new(lua_State* L, int readfd, int writefd);
+extern char** environ;
 
+#define PROC_MAX_FDS 64
+#define PROC_MAX_LIMITS 16
+
+enum { PROC_EXEC, PROC_CWD, PROC_LIMIT, PROC_FD };
+
+// Everything the child needs, prepared by the parent; after vfork, the child only makes system calls.
+typedef struct {
+    const char* path;
+    char** argv;
+    char** envp;
+    const char* cwd;
+    int stdio[3];
+    int error;
+    int fds[PROC_MAX_FDS][2];
+    int fd_count;
+    struct { int resource; struct rlimit limit; } limits[PROC_MAX_LIMITS];
+    int limit_count;
+} proc_spawn_t;
+
+static const struct { const char* name; int resource; } proc_limits[] = {
+    { "as", RLIMIT_AS }, { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU }, { "data", RLIMIT_DATA }, { "fsize", RLIMIT_FSIZE },
+    { "memlock", RLIMIT_MEMLOCK }, { "nofile", RLIMIT_NOFILE }, { "nproc", RLIMIT_NPROC }, { "rss", RLIMIT_RSS },
+    { "stack", RLIMIT_STACK }, { NULL, 0 }
+};
+
+// Runs in the vforked child, on the parent's memory, so it mustn't allocate, touch the lua_State, or return. Failures are
+// written to the error pipe, which is closed on a successful exec.
+static void proc_child(proc_spawn_t* spawn) __attribute__((noreturn));
+static void proc_child(proc_spawn_t* spawn) {
+    int report[2] = { PROC_FD, 0 };
+    struct sigaction action;
+    for (int sig = 1; sig < NSIG; ++sig) {
+        if (sigaction(sig, NULL, &action) == 0 && action.sa_handler != SIG_DFL && action.sa_handler != SIG_IGN) {
+            action.sa_handler = SIG_DFL;
+            sigaction(sig, &action, NULL);
+        }
+    }
+    // every source, and the error pipe, is first moved clear of every target, so that no mapping can clobber another's
+    // source, or the error pipe, whatever order they're in; the copies are close-on-exec, like the pipes.
+    int sources[PROC_MAX_FDS], high = 2, reporter = spawn->error;
+    for (int i = 0; i < spawn->fd_count; ++i) {
+        if (spawn->fds[i][0] > high)
+            high = spawn->fds[i][0];
+    }
+    if (reporter <= high && (reporter = fcntl(spawn->error, F_DUPFD_CLOEXEC, high + 1)) == -1) {
+        reporter = spawn->error;
+        goto error;
+    }
+    for (int i = 0; i < spawn->fd_count; ++i) {
+        // the error pipe was opened after the descriptors were chosen, so it can't be one of them; passing it on would keep
+        // it open past exec.
+        if (spawn->fds[i][1] == spawn->error) {
+            errno = EBADF;
+            goto error;
+        }
+        sources[i] = spawn->fds[i][0] == spawn->fds[i][1] ? spawn->fds[i][1] : fcntl(spawn->fds[i][1], F_DUPFD_CLOEXEC, high + 1);
+        if (sources[i] == -1)
+            goto error;
+    }
+    for (int i = 0; i < 3; ++i) {
+        if (dup2(spawn->stdio[i], i) == -1)
+            goto error;
+    }
+    for (int i = 0; i < spawn->fd_count; ++i) {
+        if ((sources[i] == spawn->fds[i][0] ? fcntl(sources[i], F_SETFD, 0) : dup2(sources[i], spawn->fds[i][0])) == -1)
+            goto error;
+    }
+    report[0] = PROC_CWD;
+    if (spawn->cwd && chdir(spawn->cwd))
+        goto error;
+    report[0] = PROC_LIMIT;
+    for (int i = 0; i < spawn->limit_count; ++i) {
+        if (setrlimit(spawn->limits[i].resource, &spawn->limits[i].limit))
+            goto error;
+    }
+    // signals a loop is handling are blocked, and the mask survives exec.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    report[0] = PROC_EXEC;
+    execve(spawn->path, spawn->argv, spawn->envp);
+    error:
+    report[1] = errno;
+    write(reporter, report, sizeof(report));
+    _exit(127);
+}
+
+// A close-on-exec pipe, kept clear of the standard descriptors, so that putting one end in place can't clobber another.
+static int proc_pipe(int fds[2]) {
+    if (syscall(SYS_pipe2, fds, O_CLOEXEC))
+        return -1;
+    for (int i = 0; i < 2; ++i) {
+        if (fds[i] < 3) {
+            int fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+            close(fds[i]);
+            fds[i] = fd;
+        }
+    }
+    if (fds[0] == -1 || fds[1] == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+// Looks a program up on the PATH, like execvp. Returns NULL if it can't be found.
+static const char* proc_search(const char* name, char* buffer, size_t size) {
+    if (strchr(name, '/'))
+        return name;
+    const char* path = getenv("PATH");
+    if (!path)
+        path = "/bin:/usr/bin";
+    while (*path) {
+        const char* end = strchr(path, ':');
+        size_t length = end ? (size_t)(end - path) : strlen(path);
+        if ((size_t)snprintf(buffer, size, "%.*s%s%s", (int)length, path, length ? "/" : "", name) < size) {
+            struct stat st;
+            if (access(buffer, X_OK) == 0 && stat(buffer, &st) == 0 && S_ISREG(st.st_mode))
+                return buffer;
+        }
+        path += end ? length + 1 : length;
+    }
+    return NULL;
+}
+
+// A list of strings from the table at `index`, as a NULL-terminated array owned by a userdata left on the stack. The
+// strings are left on the stack too, so they stay alive.
+static char** proc_strings(lua_State* L, int index) {
+    int length = lua_rawlen(L, index);
+    luaL_checkstack(L, length + 1, "too many arguments");
+    char** strings = lua_newuserdata(L, sizeof(char*) * (length + 1));
+    for (int i = 1; i <= length; ++i) {
+        lua_rawgeti(L, index, i);
+        strings[i - 1] = (char*)luaL_checkstring(L, -1);
+    }
+    strings[length] = NULL;
+    return strings;
+}
 
 // Argument 1 is a table, or a string.
-// Argumetn 2 is a table with options.
+// Argument 2 is a table with options: `env`, a list of `KEY=value` strings (defaults to this process' environment),
+// `cwd`, `limits`, a table of resource limits, like `{ nofile = 1024, cpu = { 10, 20 } }`, and `fds`, a table of
+// descriptors to pass on, as `{ [child_fd] = parent_fd }`. Nothing else is inherited, apart from descriptors
+// opened without close-on-exec.
 static int f_proc_new(lua_State* L) {
-    int stdout_pipe[2];
-    int stderr_pipe[2];
-    int stdin_pipe[2];
-    if (pipe(stdout_pipe) || pipe(stderr_pipe) || pipe(stdin_pipe))
-        return luaL_error(L, "error creating pipes");
     luaL_checktype(L, 1, LUA_TTABLE);
-    int pid = fork();
-    if (pid < 0) {   
+    int options = lua_type(L, 2) == LUA_TTABLE ? 2 : 0;
+    proc_spawn_t spawn = {0};
+    char path[PATH_MAX];
+    spawn.argv = proc_strings(L, 1);
+    luaL_argcheck(L, spawn.argv[0], 1, "no program given");
+    spawn.envp = environ;
+    if (options) {
+        if (lua_getfield(L, options, "env") == LUA_TTABLE)
+            spawn.envp = proc_strings(L, lua_gettop(L));
+        if (lua_getfield(L, options, "cwd") != LUA_TNIL)
+            spawn.cwd = luaL_checkstring(L, -1);
+        if (lua_getfield(L, options, "limits") == LUA_TTABLE) {
+            for (int i = 0; proc_limits[i].name; ++i) {
+                int type = lua_getfield(L, -1, proc_limits[i].name);
+                if (type != LUA_TNIL && spawn.limit_count < PROC_MAX_LIMITS) {
+                    spawn.limits[spawn.limit_count].resource = proc_limits[i].resource;
+                    if (type == LUA_TTABLE) {
+                        lua_rawgeti(L, -1, 1), lua_rawgeti(L, -2, 2);
+                        spawn.limits[spawn.limit_count].limit.rlim_cur = luaL_checkinteger(L, -2);
+                        spawn.limits[spawn.limit_count].limit.rlim_max = luaL_checkinteger(L, -1);
+                        lua_pop(L, 2);
+                    } else
+                        spawn.limits[spawn.limit_count].limit.rlim_cur = spawn.limits[spawn.limit_count].limit.rlim_max = luaL_checkinteger(L, -1);
+                    ++spawn.limit_count;
+                }
+                lua_pop(L, 1);
+            }
+        }
+        if (lua_getfield(L, options, "fds") == LUA_TTABLE) {
+            lua_pushnil(L);
+            while (lua_next(L, -2)) {
+                luaL_argcheck(L, spawn.fd_count < PROC_MAX_FDS, 2, "too many descriptors");
+                spawn.fds[spawn.fd_count][0] = luaL_checkinteger(L, -2);
+                spawn.fds[spawn.fd_count][1] = luaL_checkinteger(L, -1);
+                luaL_argcheck(L, spawn.fds[spawn.fd_count][0] > 2, 2, "can't replace stdin, stdout or stderr");
+                ++spawn.fd_count;
+                lua_pop(L, 1);
+            }
+        }
+    }
+    spawn.path = proc_search(spawn.argv[0], path, sizeof(path));
+    if (!spawn.path)
+        return luaL_error(L, "error opening process at %s: %s", spawn.argv[0], strerror(ENOENT));
+    int stdout_pipe[2] = { -1, -1 };
+    int stderr_pipe[2] = { -1, -1 };
+    int stdin_pipe[2] = { -1, -1 };
+    int error_pipe[2] = { -1, -1 };
+    if (proc_pipe(stdout_pipe) || proc_pipe(stderr_pipe) || proc_pipe(stdin_pipe) || proc_pipe(error_pipe)) {
+        int error = errno;
         for (int i = 0; i < 2; ++i) {
             close(stdout_pipe[i]);
             close(stderr_pipe[i]);
             close(stdin_pipe[i]);
+            close(error_pipe[i]);
         }
-        return luaL_error(L, "error forking process: %s", strerror(errno));
-    } else if (!pid) {
+        return luaL_error(L, "error creating pipes: %s", strerror(error));
+    }
+    spawn.stdio[0] = stdin_pipe[0], spawn.stdio[1] = stdout_pipe[1], spawn.stdio[2] = stderr_pipe[1];
+    spawn.error = error_pipe[1];
+    // no handlers can run in the child until it's reset them.
+    sigset_t all, mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &mask);
+    int pid = vfork();
+    if (pid == 0)
+        proc_child(&spawn);
+    int error = errno;
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+    close(stdout_pipe[1]);
+    close(stderr_pipe[1]);
+    close(stdin_pipe[0]);
+    close(error_pipe[1]);
+    int report[2];
+    ssize_t reported = pid > 0 ? read(error_pipe[0], report, sizeof(report)) : 0;
+    close(error_pipe[0]);
+    if (pid < 0 || reported == sizeof(report)) {
         close(stdout_pipe[0]);
         close(stderr_pipe[0]);
         close(stdin_pipe[1]);
-        const char* argv[256] = {0};
-        const char* envp[256] = {0};
-        size_t len = lua_rawlen(L, 1);
-        for (int i = 1; i <= len && i < 256; ++i) {
-            lua_rawgeti(L, 1, i);
-            argv[i - 1] = lua_tostring(L, -1);
-            lua_pop(L, 1);
+        if (pid < 0)
+            return luaL_error(L, "error forking process: %s", strerror(error));
+        int status;
+        waitpid(pid, &status, 0);
+        switch (report[0]) {
+            case PROC_EXEC: return luaL_error(L, "error opening process at %s: %s", spawn.path, strerror(report[1]));
+            case PROC_CWD: return luaL_error(L, "error changing directory to %s: %s", spawn.cwd, strerror(report[1]));
+            case PROC_LIMIT: return luaL_error(L, "error setting resource limits: %s", strerror(report[1]));
+            default: return luaL_error(L, "error passing on descriptors: %s", strerror(report[1]));
         }
-        if (lua_type(L, 2) == LUA_TTABLE) {
-            lua_getfield(L, 2, "env");
-            if (!lua_isnil(L, -1)) {
-                size_t len = lua_rawlen(L, -1);
-                for (int i = 1; i <= len && i < 256; ++i) {
-                    lua_rawgeti(L, -1, i);
-                    envp[i - 1] = lua_tostring(L, -1);
-                    lua_pop(L, 1);
-                }
-            }
-            lua_pop(L, 1);
-        }
-        dup2(stdin_pipe[0], 0);
-        dup2(stdout_pipe[1], 1);
-        dup2(stderr_pipe[1], 2);
-        execvpe(argv[0], (char* const*)argv, (char* const*)envp);
-        fprintf(stderr, "error opening process at %s: %s", argv[0], strerror(errno));
-        fflush(stderr);
-        exit(-1);
     }
-    close(stdout_pipe[1]);
-    close(stderr_pipe[1]);
-    close(stdin_pipe[0]);
     fcntl(stdout_pipe[0], F_SETFL, fcntl(stdout_pipe[0], F_GETFL, 0) | O_NONBLOCK);
     fcntl(stderr_pipe[0], F_SETFL, fcntl(stderr_pipe[0], F_GETFL, 0) | O_NONBLOCK);
     fcntl(stdin_pipe[1], F_SETFL, fcntl(stdin_pipe[1], F_GETFL, 0) | O_NONBLOCK);
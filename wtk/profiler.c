@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+int luaW_loadblock(lua_State* L, const char* name, int line, const char* str);
+int luaW_heapsample(lua_State* L, long long interval);
+size_t luaW_heapsampled(lua_State* L);
+
+// A sampling profiler; SIGPROF only sets a flag, and a count hook on every hooked thread notices it within a few hundred
+// instructions, and records the stack. Stacks are aggregated as folded strings ("outer;inner;innermost") in a hash table,
+// so `dump` can be fed straight into flamegraph.pl. Hooks are only installed while profiling, so when stopped, it costs nothing.
+// If the state was created with luaW_newstate, allocations can be sampled the same way; every so many bytes allocated are
+// attributed to the stack the hook next sees, giving a flamegraph of where memory is allocated.
+#define PROFILER_HOOK_COUNT 100
+#define PROFILER_MAX_DEPTH 64
+#define PROFILER_MAX_RESUMERS 32
+#define PROFILER_STACK_LENGTH 4096
+
+typedef struct {
+    char* stack;
+    size_t length;
+    lua_Integer count;
+} profiler_sample_t;
+
+typedef struct {
+    profiler_sample_t* samples;
+    size_t capacity, count;
+    lua_Integer total, dropped;
+} profiler_table_t;
+
+static volatile sig_atomic_t profiler_pending;
+static int profiler_running;
+static lua_Hook profiler_previous_hook;
+static int profiler_previous_mask, profiler_previous_count;
+static lua_State* profiler_main;
+// the threads that resumed the currently running coroutine, so that coroutine stacks can be prefixed with where they were resumed from.
+static lua_State* profiler_resumers[PROFILER_MAX_RESUMERS];
+static int profiler_resumer_count;
+static profiler_table_t profiler_cpu, profiler_allocations;
+static int profiler_sampling_allocations;
+
+static void profiler_signal(int sig) { (void)sig; profiler_pending = 1; }
+
+static uint32_t profiler_hash(const char* str, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
+
+static void profiler_clear(profiler_table_t* table) {
+    for (size_t i = 0; i < table->capacity; ++i)
+        free(table->samples[i].stack);
+    free(table->samples);
+    memset(table, 0, sizeof(profiler_table_t));
+}
+
+static int profiler_grow(profiler_table_t* table) {
+    size_t capacity = table->capacity ? table->capacity * 2 : 1024;
+    profiler_sample_t* samples = calloc(capacity, sizeof(profiler_sample_t));
+    if (!samples)
+        return -1;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->samples[i].stack) {
+            size_t index = profiler_hash(table->samples[i].stack, table->samples[i].length) & (capacity - 1);
+            while (samples[index].stack)
+                index = (index + 1) & (capacity - 1);
+            samples[index] = table->samples[i];
+        }
+    }
+    free(table->samples);
+    table->samples = samples;
+    table->capacity = capacity;
+    return 0;
+}
+
+static void profiler_record(profiler_table_t* table, const char* stack, size_t length, lua_Integer weight) {
+    table->total += weight;
+    if ((table->count + 1) * 2 > table->capacity && profiler_grow(table)) {
+        table->dropped += weight;
+        return;
+    }
+    size_t index = profiler_hash(stack, length) & (table->capacity - 1);
+    while (table->samples[index].stack) {
+        if (table->samples[index].length == length && memcmp(table->samples[index].stack, stack, length) == 0) {
+            table->samples[index].count += weight;
+            return;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+    char* copy = malloc(length);
+    if (!copy) {
+        table->dropped += weight;
+        return;
+    }
+    memcpy(copy, stack, length);
+    table->samples[index] = (profiler_sample_t){ copy, length, weight };
+    ++table->count;
+}
+
+// Appends the frames of a thread, outermost first, returning the new length.
+static size_t profiler_append_frames(lua_State* L, char* buffer, size_t length) {
+    lua_Debug frames[PROFILER_MAX_DEPTH];
+    int depth = 0;
+    while (depth < PROFILER_MAX_DEPTH && lua_getstack(L, depth, &frames[depth]))
+        ++depth;
+    for (int i = depth - 1; i >= 0; --i) {
+        lua_getinfo(L, "Sn", &frames[i]);
+        int written;
+        if (frames[i].what[0] == 'C')
+            written = snprintf(&buffer[length], PROFILER_STACK_LENGTH - length, "%s[C] %s", length ? ";" : "", frames[i].name ? frames[i].name : "?");
+        else
+            written = snprintf(&buffer[length], PROFILER_STACK_LENGTH - length, "%s%s %s:%d", length ? ";" : "", frames[i].name ? frames[i].name : (frames[i].what[0] == 'm' ? "main" : "?"), frames[i].short_src, frames[i].linedefined);
+        if (written < 0 || length + written >= PROFILER_STACK_LENGTH)
+            return length;
+        // semicolons in frames would confuse anything reading the folded stacks.
+        for (size_t j = length + 1; j < length + written; ++j) {
+            if (buffer[j] == ';')
+                buffer[j] = ',';
+        }
+        length += written;
+    }
+    return length;
+}
+
+static void profiler_hook(lua_State* L, lua_Debug* ar) {
+    if (profiler_previous_hook)
+        profiler_previous_hook(L, ar);
+    if (!profiler_running) {
+        // left over on a coroutine from a previous run; put back whatever was there before.
+        lua_sethook(L, profiler_previous_hook, profiler_previous_mask, profiler_previous_count);
+        return;
+    }
+    size_t allocated = profiler_sampling_allocations ? luaW_heapsampled(L) : 0;
+    if (!profiler_pending && !allocated)
+        return;
+    char buffer[PROFILER_STACK_LENGTH];
+    size_t length = 0;
+    for (int i = 0; i < profiler_resumer_count && i < PROFILER_MAX_RESUMERS; ++i) {
+        if (profiler_resumers[i] != L)
+            length = profiler_append_frames(profiler_resumers[i], buffer, length);
+    }
+    length = profiler_append_frames(L, buffer, length);
+    if (length == 0)
+        return;
+    if (profiler_pending) {
+        profiler_pending = 0;
+        profiler_record(&profiler_cpu, buffer, length, 1);
+    }
+    if (allocated)
+        profiler_record(&profiler_allocations, buffer, length, allocated);
+}
+
+// Replaces `coroutine.resume` while profiling, so that coroutines created before profiling started are sampled too.
+static int f_profiler_resume(lua_State* L) {
+    lua_State* co = lua_tothread(L, 1);
+    if (profiler_running && co && lua_gethook(co) != profiler_hook)
+        lua_sethook(co, profiler_hook, LUA_MASKCOUNT, PROFILER_HOOK_COUNT);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    int base = lua_gettop(L) - 1;
+    if (profiler_resumer_count < PROFILER_MAX_RESUMERS)
+        profiler_resumers[profiler_resumer_count] = L;
+    ++profiler_resumer_count;
+    int status = lua_pcall(L, base, LUA_MULTRET, 0);
+    --profiler_resumer_count;
+    if (status)
+        return lua_error(L);
+    return lua_gettop(L);
+}
+
+// Argument 1 is the sampling frequency, in hertz, of CPU time; 0 to not sample CPU time. Argument 2 is how many bytes
+// to allocate between allocation samples; 0, or absent, to not sample allocations.
+static int f_profiler_start(lua_State* L) {
+    int hz = luaL_optinteger(L, 1, 1000);
+    lua_Integer interval = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, hz >= 0 && hz <= 1000000, 1, "frequency must be between 0 and 1000000");
+    luaL_argcheck(L, interval >= 0, 2, "interval must be positive");
+    if (profiler_running)
+        return luaL_error(L, "profiler already running");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    profiler_main = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    profiler_previous_hook = lua_gethook(profiler_main);
+    profiler_previous_mask = lua_gethookmask(profiler_main);
+    profiler_previous_count = lua_gethookcount(profiler_main);
+    struct sigaction action = {0};
+    action.sa_handler = profiler_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL))
+        return luaL_error(L, "unable to install SIGPROF handler: %s", strerror(errno));
+    if (interval > 0 && !luaW_heapsample(L, interval))
+        return luaL_error(L, "can't sample allocations; state wasn't created with luaW_newstate");
+    profiler_sampling_allocations = interval > 0;
+    profiler_running = 1;
+    profiler_pending = 0;
+    lua_sethook(profiler_main, profiler_hook, LUA_MASKCOUNT | profiler_previous_mask, profiler_previous_hook ? profiler_previous_count : PROFILER_HOOK_COUNT);
+    if (L != profiler_main)
+        lua_sethook(L, profiler_hook, LUA_MASKCOUNT, PROFILER_HOOK_COUNT);
+    lua_getglobal(L, "coroutine");
+    lua_getfield(L, -1, "resume");
+    lua_setfield(L, LUA_REGISTRYINDEX, "wtk.profiler.c.resume");
+    lua_getfield(L, LUA_REGISTRYINDEX, "wtk.profiler.c.resume");
+    lua_pushcclosure(L, f_profiler_resume, 1);
+    lua_setfield(L, -2, "resume");
+    lua_pop(L, 1);
+    if (hz > 0) {
+        struct itimerval timer = {0};
+        timer.it_interval.tv_usec = timer.it_value.tv_usec = hz == 1 ? 999999 : 1000000 / hz;
+        setitimer(ITIMER_PROF, &timer, NULL);
+    }
+    return 0;
+}
+
+static int f_profiler_stop(lua_State* L) {
+    if (!profiler_running)
+        return 0;
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    if (profiler_sampling_allocations)
+        luaW_heapsample(L, 0);
+    profiler_sampling_allocations = 0;
+    profiler_running = 0;
+    lua_sethook(profiler_main, profiler_previous_hook, profiler_previous_mask, profiler_previous_count);
+    lua_getglobal(L, "coroutine");
+    lua_getfield(L, LUA_REGISTRYINDEX, "wtk.profiler.c.resume");
+    lua_setfield(L, -2, "resume");
+    lua_pop(L, 1);
+    return 0;
+}
+
+static const char* profiler_kinds[] = { "cpu", "allocations", NULL };
+
+// Returns the folded stacks sampled so far, one per line, followed by their count; for allocations, the count is in bytes.
+// Argument 1 clears them, argument 2 is the kind of samples; "cpu", or "allocations".
+static int f_profiler_dump(lua_State* L) {
+    int reset = lua_toboolean(L, 1);
+    profiler_table_t* table = luaL_checkoption(L, 2, "cpu", profiler_kinds) ? &profiler_allocations : &profiler_cpu;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->samples[i].stack) {
+            luaL_addlstring(&b, table->samples[i].stack, table->samples[i].length);
+            lua_pushfstring(L, " %I\n", table->samples[i].count);
+            luaL_addvalue(&b);
+        }
+    }
+    luaL_pushresult(&b);
+    if (reset)
+        profiler_clear(table);
+    return 1;
+}
+
+static int f_profiler_stats(lua_State* L) {
+    lua_newtable(L);
+    lua_pushboolean(L, profiler_running); lua_setfield(L, -2, "running");
+    lua_pushinteger(L, profiler_cpu.total); lua_setfield(L, -2, "samples");
+    lua_pushinteger(L, profiler_cpu.count); lua_setfield(L, -2, "stacks");
+    lua_pushinteger(L, profiler_cpu.dropped); lua_setfield(L, -2, "dropped");
+    lua_pushinteger(L, profiler_allocations.total); lua_setfield(L, -2, "allocated");
+    lua_pushinteger(L, profiler_allocations.count); lua_setfield(L, -2, "allocation_stacks");
+    return 1;
+}
+
+static const luaL_Reg f_profiler_api[] = {
+    { "start",     f_profiler_start   },
+    { "stop",      f_profiler_stop    },
+    { "dump",      f_profiler_dump    },
+    { "stats",     f_profiler_stats   },
+    { NULL,        NULL               }
+};
+
+int luaopen_wtk_profiler_c(lua_State* L) {
+    lua_newtable(L);
+    luaL_setfuncs(L, f_profiler_api, 0);
+    if (luaW_loadblock(L, __FILE__, __LINE__, "\n\
+    local profiler = ...\n\
+    -- From inside a job; profiles everything the loop does for `seconds`, and returns the folded stacks sampled for CPU\n\
+    -- time, and for allocations, if an `interval` was given.\n\
+    function profiler.profile(seconds, hz, interval)\n\
+        assert(coroutine.isyieldable(), 'profiler.profile must be called from a job')\n\
+        profiler.dump(true, 'cpu')\n\
+        profiler.dump(true, 'allocations')\n\
+        profiler.start(hz, interval)\n\
+        coroutine.yield(seconds or 10)\n\
+        profiler.stop()\n\
+        return profiler.dump(true, 'cpu'), profiler.dump(true, 'allocations')\n\
+    end\n\
+    -- The `n` functions that the most samples were taken in (or for allocations, the most bytes allocated from),\n\
+    -- as a list of { frame, count }.\n\
+    function profiler.top(n, kind)\n\
+        local totals, sites = { }, { }\n\
+        for stack, count in profiler.dump(false, kind):gmatch('([^\\n]+) (%d+)\\n') do\n\
+            local frame = stack:match('[^;]+$')\n\
+            if not totals[frame] then table.insert(sites, frame) end\n\
+            totals[frame] = (totals[frame] or 0) + tonumber(count)\n\
+        end\n\
+        table.sort(sites, function(a, b) return totals[a] > totals[b] end)\n\
+        local top = { }\n\
+        for i = 1, math.min(n or 10, #sites) do top[i] = { sites[i], totals[sites[i]] } end\n\
+        return top\n\
+    end\n\
+    return profiler"))
+        return lua_error(L);
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 1);
+    return 1;
+}
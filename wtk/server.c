@@ -3,6 +3,9 @@
 #include <lauxlib.h>
 #include <math.h>
 #include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -13,6 +16,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 
@@ -22,46 +26,55 @@ static int server_imin(int a, int b) { return a < b ? a : b; }
 static int server_imax(int a, int b) { return a > b ? a : b; }
 
 static char base64_encode[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-static int f_base64_decode(lua_State* L) {
-	static int base64_decode[256] = {0};
-  if (!base64_decode['B']) {
-    for (int i = 0; i < 64; ++i)
-      base64_decode[base64_encode[i]] = i;
-  }
-  size_t source_length, target_length;
-  unsigned char* data = (unsigned char*)luaL_checklstring(L, 1, &source_length);
-  target_length = ceil(source_length * 6.0 / 8);
-  luaL_Buffer buffer;
-  luaL_buffinitsize(L, &buffer, target_length);
-  int accumulator;
-  for (int i = 0; i < target_length && data[i] != '='; ++i) {
+static int base64_decode[256] = {0};
+
+// The coders write into a buffer big enough for the whole result, rather than a luaL_Buffer, so that they can be offloaded.
+// Like the Lua strings they're normally given, `data` must be followed by a NUL.
+static size_t base64_decode_into(const unsigned char* data, size_t source_length, char* target) {
+  // padding carries no bits; only whole bytes are decoded from what's left.
+  while (source_length > 0 && data[source_length - 1] == '=')
+    --source_length;
+  size_t target_length = source_length * 6 / 8, length = 0;
+  for (size_t i = 0; i < target_length; ++i) {
     switch (i % 3) {
-      case 0: luaL_addchar(&buffer, (base64_decode[data[(i * 8) / 6]] << 2) | (base64_decode[data[(i * 8) / 6 + 1]] >> 4)); break;
-      case 1: luaL_addchar(&buffer, ((base64_decode[data[(i * 8) / 6]] & 0xF) << 4) | (base64_decode[data[(i * 8) / 6 + 1]] >> 2)); break;
-      case 2: luaL_addchar(&buffer, ((base64_decode[data[(i * 8) / 6]] & 0x3) << 6) | (base64_decode[data[(i * 8) / 6 + 1]])); break;
+      case 0: target[length++] = (base64_decode[data[(i * 8) / 6]] << 2) | (base64_decode[data[(i * 8) / 6 + 1]] >> 4); break;
+      case 1: target[length++] = ((base64_decode[data[(i * 8) / 6]] & 0xF) << 4) | (base64_decode[data[(i * 8) / 6 + 1]] >> 2); break;
+      case 2: target[length++] = ((base64_decode[data[(i * 8) / 6]] & 0x3) << 6) | (base64_decode[data[(i * 8) / 6 + 1]]); break;
     }
   }
-  luaL_pushresult(&buffer);
-  return 1;
+  return length;
 }
 
-static int f_base64_encode(lua_State* L) {
-  size_t source_length, target_length;
-  unsigned const char* data = luaL_checklstring(L, 1, &source_length);
-  target_length = ceil(source_length * 8.0 / 6);
-  luaL_Buffer buffer;
-  luaL_buffinitsize(L, &buffer, target_length);
+static size_t base64_encode_into(const unsigned char* data, size_t source_length, char* target) {
+  size_t target_length = ceil(source_length * 8.0 / 6), length = 0;
   for (int i = 0; i < target_length; ++i) {
     switch (i % 4) {
-      case 0: luaL_addchar(&buffer, base64_encode[data[(i * 6) / 8] >> 2]); break;
-      case 1: luaL_addchar(&buffer, base64_encode[((data[(i * 6) / 8] & 0x3) << 4) | ((data[(i * 6) / 8 + 1] >> 4) & 0xF)]); break;
-      case 2: luaL_addchar(&buffer, base64_encode[((data[(i * 6) / 8] & 0xF) << 2) | (data[(i * 6) / 8 + 1] >> 6)]); break;
-      case 3: luaL_addchar(&buffer, base64_encode[(data[(i * 6) / 8] & 0x3F)]); break;
+      case 0: target[length++] = base64_encode[data[(i * 6) / 8] >> 2]; break;
+      case 1: target[length++] = base64_encode[((data[(i * 6) / 8] & 0x3) << 4) | ((data[(i * 6) / 8 + 1] >> 4) & 0xF)]; break;
+      case 2: target[length++] = base64_encode[((data[(i * 6) / 8] & 0xF) << 2) | (data[(i * 6) / 8 + 1] >> 6)]; break;
+      case 3: target[length++] = base64_encode[(data[(i * 6) / 8] & 0x3F)]; break;
     }
   }
   for (int i = 0; (target_length + i) % 4 != 0; ++i)
-    luaL_addchar(&buffer, '=');
-  luaL_pushresult(&buffer);
+    target[length++] = '=';
+  return length;
+}
+
+static int f_base64_decode(lua_State* L) {
+  size_t source_length;
+  const unsigned char* data = (const unsigned char*)luaL_checklstring(L, 1, &source_length);
+  luaL_Buffer buffer;
+  char* target = luaL_buffinitsize(L, &buffer, ceil(source_length * 6.0 / 8) + 1);
+  luaL_pushresultsize(&buffer, base64_decode_into(data, source_length, target));
+  return 1;
+}
+
+static int f_base64_encode(lua_State* L) {
+  size_t source_length;
+  const unsigned char* data = (const unsigned char*)luaL_checklstring(L, 1, &source_length);
+  luaL_Buffer buffer;
+  char* target = luaL_buffinitsize(L, &buffer, ceil(source_length * 8.0 / 6) + 4);
+  luaL_pushresultsize(&buffer, base64_encode_into(data, source_length, target));
   return 1;
 }
 
@@ -238,6 +251,48 @@ static const luaL_Reg sha1_lib[] = {
   { NULL,       NULL }
 };
 
+#ifndef LUAW_OFFLOAD_T
+  #define LUAW_OFFLOAD_T
+  // CPU-heavy work that wtk's thread pool can run; see `wtk.Loop:offload`.
+  typedef const char* (*luaW_offload_f)(const char* input, size_t length, int option, char** output, size_t* output_length);
+  typedef struct { const char* name; luaW_offload_f run; } luaW_offload_t;
+#endif
+
+static const char* server_offload_sha1(const char* input, size_t length, int option, char** output, size_t* output_length) {
+  (void)option;
+  SHA1_CTX ctx;
+  if (!(*output = malloc(SHA1_BLOCK_SIZE)))
+    return "out of memory";
+  sha1_init(&ctx);
+  sha1_update(&ctx, (const BYTE*)input, length);
+  sha1_final(&ctx, (BYTE*)*output);
+  *output_length = SHA1_BLOCK_SIZE;
+  return NULL;
+}
+
+static const char* server_offload_base64_encode(const char* input, size_t length, int option, char** output, size_t* output_length) {
+  (void)option;
+  if (!(*output = malloc(ceil(length * 8.0 / 6) + 4)))
+    return "out of memory";
+  *output_length = base64_encode_into((const unsigned char*)input, length, *output);
+  return NULL;
+}
+
+static const char* server_offload_base64_decode(const char* input, size_t length, int option, char** output, size_t* output_length) {
+  (void)option;
+  if (!(*output = malloc(ceil(length * 6.0 / 8) + 1)))
+    return "out of memory";
+  *output_length = base64_decode_into((const unsigned char*)input, length, *output);
+  return NULL;
+}
+
+static const luaW_offload_t server_offloads[] = {
+  { "sha1",           server_offload_sha1          },
+  { "base64_encode",  server_offload_base64_encode },
+  { "base64_decode",  server_offload_base64_decode },
+  { NULL,             NULL                         }
+};
+
 static int f_server_socket_bind(lua_State *L) {
   struct sockaddr* bind_addr = NULL;
   struct sockaddr_in in_bind_addr = {0};
@@ -281,6 +336,14 @@ static int f_server_socket_accept(lua_State* L) {
   socklen_t peer_addr_len = sizeof(peer_addr);
   server_socket_t* sock = luaL_checkudata(L, 1, "wtk.server.c.socket");
   int fd = accept(sock->fd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+  if (fd == -1) {
+    lua_pushnil(L);
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      lua_pushliteral(L, "timeout");
+    else
+      lua_pushstring(L, strerror(errno));
+    return 2;
+  }
   int flags = fcntl(fd, F_GETFL, 0);
 	if (flags == -1 || fcntl(fd, F_SETFL, (flags | O_NONBLOCK)) == -1) 
 		return luaL_error(L, "error setting non-blocking: %s", strerror(errno));
@@ -336,25 +399,38 @@ static int f_server_socket_close(lua_State* L) {
   return 1;
 }
 
+// Reads into the stack until that's full, so that the usual short read costs one string, rather than a buffer the size
+// of the request and then a copy. A short read means the socket's drained, so there's no point asking again.
 static int f_server_socket_recv(lua_State* L) {
   server_socket_t* sock = luaL_checkudata(L, 1, "wtk.server.c.socket");
-  int bytes = luaL_checkinteger(L, 2), length = 0, total_received = 0;
+  int bytes = luaL_checkinteger(L, 2), length = 0, total_received = 0, buffered = 0;
   int err = 0;
   luaL_Buffer buffer;
   char chunk[4096];
-  luaL_buffinitsize(L, &buffer, bytes);
   while (bytes > 0) {
-    length = recv(sock->fd, chunk, server_imin(sizeof(chunk), bytes), 0);
+    if (!buffered && total_received == sizeof(chunk)) {
+      luaL_buffinitsize(L, &buffer, total_received + bytes);
+      luaL_addlstring(&buffer, chunk, total_received);
+      buffered = 1;
+    }
+    int wanted = server_imin(buffered ? sizeof(chunk) : sizeof(chunk) - total_received, bytes);
+    length = recv(sock->fd, buffered ? luaL_prepbuffsize(&buffer, wanted) : &chunk[total_received], wanted, 0);
     if (length > 0) {
       bytes -= length;
-      luaL_addlstring(&buffer, chunk, length);
       total_received += length;
+      if (buffered)
+        luaL_addsize(&buffer, length);
+      if (length < wanted)
+        break;
     } else {
 			err = errno;
 			break;
 		}
   }
-  luaL_pushresult(&buffer);  
+  if (buffered)
+    luaL_pushresult(&buffer);
+  else
+    lua_pushlstring(L, chunk, total_received);
   if (length < 0 && (err == EAGAIN || err == EWOULDBLOCK))
 		lua_pushliteral(L, "timeout");
 	else if (length < 0 && err == ECONNRESET)
@@ -368,11 +444,29 @@ static int f_server_socket_recv(lua_State* L) {
   return 2;
 }
 
+#ifndef LUAW_VIEW_T
+  #define LUAW_VIEW_T
+  typedef struct { const char* data; size_t length; } luaW_view_t;
+#endif
+
+// Strings, or views (wtk.c.view) onto memory Lua doesn't own, like packed files, which are sent without being copied.
+static const char* server_checkbytes(lua_State* L, int index, size_t* length) {
+  luaW_view_t* view = luaL_testudata(L, index, "wtk.c.view");
+  if (!view)
+    return luaL_checklstring(L, index, length);
+  *length = view->length;
+  return view->data;
+}
+
+// Sends as much of the packet as the socket will take, skipping the first `offset` bytes.
 static int f_server_socket_send(lua_State* L) {
   server_socket_t* sock = luaL_checkudata(L, 1, "wtk.server.c.socket");
   size_t packet_length;
-  const char* packet = luaL_checklstring(L, 2, &packet_length);
-  int res = send(sock->fd, packet, packet_length, 0);
+  const char* packet = server_checkbytes(L, 2, &packet_length);
+  size_t offset = luaL_optinteger(L, 3, 0);
+  if (offset > packet_length)
+    offset = packet_length;
+  int res = send(sock->fd, &packet[offset], packet_length - offset, 0);
   if (res == -1) {
 		lua_pushnil(L);
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -391,6 +485,91 @@ static int f_server_socket_send(lua_State* L) {
 }
 
 
+// Writes as much of a queue of strings as the socket will take in a single writev.
+// The queue is a table of strings, with `offset` being the amount of the first string
+// already sent. Fully sent strings are removed from the front of the queue.
+#define SERVER_MAX_IOV 64
+static int f_server_socket_sendv(lua_State* L) {
+  server_socket_t* sock = luaL_checkudata(L, 1, "wtk.server.c.socket");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_getfield(L, 2, "offset");
+  size_t offset = luaL_optinteger(L, -1, 0);
+  lua_pop(L, 1);
+  int length = lua_rawlen(L, 2), count = 0;
+  struct iovec iov[SERVER_MAX_IOV];
+  for (int i = 1; i <= length && count < SERVER_MAX_IOV; ++i, ++count) {
+    size_t chunk_length;
+    lua_rawgeti(L, 2, i);
+    const char* chunk = server_checkbytes(L, -1, &chunk_length);
+    lua_pop(L, 1);
+    size_t skip = i == 1 ? (offset < chunk_length ? offset : chunk_length) : 0;
+    iov[count].iov_base = (char*)&chunk[skip];
+    iov[count].iov_len = chunk_length - skip;
+  }
+  if (count == 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  ssize_t written = writev(sock->fd, iov, count);
+  if (written == -1) {
+    lua_pushnil(L);
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      lua_pushliteral(L, "timeout");
+    else if (errno == ECONNRESET)
+      lua_pushliteral(L, "reset");
+    else if (errno == EPIPE)
+      lua_pushliteral(L, "pipe");
+    else
+      lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  size_t remaining = written;
+  int sent = 0;
+  while (sent < count && remaining >= iov[sent].iov_len)
+    remaining -= iov[sent++].iov_len;
+  if (sent > 0) {
+    for (int i = sent + 1; i <= length; ++i) {
+      lua_rawgeti(L, 2, i);
+      lua_rawseti(L, 2, i - sent);
+    }
+    for (int i = length - sent + 1; i <= length; ++i) {
+      lua_pushnil(L);
+      lua_rawseti(L, 2, i);
+    }
+    offset = 0;
+  }
+  lua_pushinteger(L, offset + remaining);
+  lua_setfield(L, 2, "offset");
+  lua_pushinteger(L, written);
+  return 1;
+}
+
+// Duplicates a peer socket, so that it can be registered with a loop for writing
+// independently of whatever job is currently waiting on it for reading.
+static int f_server_socket_dup(lua_State* L) {
+  server_socket_t* sock = luaL_checkudata(L, 1, "wtk.server.c.socket");
+  int fd = dup(sock->fd);
+  if (fd == -1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "error duplicating socket: %s", strerror(errno));
+    return 2;
+  }
+  server_socket_t* copy = lua_newuserdata(L, sizeof(server_socket_t));
+  copy->fd = fd;
+  copy->peer = 1;
+  luaL_setmetatable(L, "wtk.server.c.socket");
+  return 1;
+}
+
+// Whether the peer has hung up, without consuming anything it's sent. A peer with unread data pending counts as connected.
+static int f_server_socket_closed(lua_State* L) {
+  server_socket_t* sock = luaL_checkudata(L, 1, "wtk.server.c.socket");
+  char c;
+  int received = recv(sock->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  lua_pushboolean(L, received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR));
+  return 1;
+}
+
 static const luaL_Reg server_socket_lib[] = {
   { "bind",      f_server_socket_bind   },
   { "accept",    f_server_socket_accept },
@@ -398,10 +577,260 @@ static const luaL_Reg server_socket_lib[] = {
   { "close",     f_server_socket_close  },
   { "send",      f_server_socket_send   },
   { "recv",      f_server_socket_recv   },
+  { "sendv",     f_server_socket_sendv  },
+  { "dup",       f_server_socket_dup    },
+  { "closed",    f_server_socket_closed },
   { "__gc",      f_server_socket_close  },
   { NULL,        NULL }
 };
 
+// Frames a message as a single, unmasked, final websocket frame.
+static int f_websocket_frame(lua_State* L) {
+  size_t length;
+  const char* message = luaL_checklstring(L, 1, &length);
+  int opcode = luaL_optinteger(L, 2, 0x1);
+  unsigned char header[10];
+  int header_length = 2;
+  header[0] = 0x80 | (opcode & 0xF);
+  if (length <= 125)
+    header[1] = length;
+  else if (length <= 65535) {
+    header[1] = 126;
+    header[2] = (length >> 8) & 0xFF;
+    header[3] = length & 0xFF;
+    header_length = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; ++i)
+      header[2 + i] = ((unsigned long long)length >> (56 - i * 8)) & 0xFF;
+    header_length = 10;
+  }
+  luaL_Buffer buffer;
+  luaL_buffinitsize(L, &buffer, header_length + length);
+  luaL_addlstring(&buffer, (const char*)header, header_length);
+  luaL_addlstring(&buffer, message, length);
+  luaL_pushresult(&buffer);
+  return 1;
+}
+
+static const luaL_Reg websocket_lib[] = {
+  { "frame",     f_websocket_frame      },
+  { NULL,        NULL }
+};
+
+// Adds a server-sent event field; multi-line values are split into one field per line.
+static void sse_add_field(luaL_Buffer* buffer, const char* name, const char* value, size_t length) {
+  size_t start = 0;
+  for (size_t i = 0; i <= length; ++i) {
+    if (i == length || value[i] == '\n' || value[i] == '\r') {
+      luaL_addstring(buffer, name);
+      luaL_addlstring(buffer, ": ", 2);
+      luaL_addlstring(buffer, &value[start], i - start);
+      luaL_addchar(buffer, '\n');
+      if (i + 1 < length && value[i] == '\r' && value[i + 1] == '\n')
+        ++i;
+      start = i + 1;
+    }
+  }
+}
+
+static int f_sse_frame(lua_State* L) {
+  size_t data_length = 0, event_length = 0, id_length = 0;
+  const char* data = luaL_optlstring(L, 1, NULL, &data_length);
+  const char* event = luaL_optlstring(L, 2, NULL, &event_length);
+  const char* id = luaL_optlstring(L, 3, NULL, &id_length);
+  const char* retry = lua_isnoneornil(L, 4) ? NULL : lua_tostring(L, 4);
+  luaL_Buffer buffer;
+  luaL_buffinitsize(L, &buffer, data_length + event_length + id_length + 32);
+  if (event)
+    sse_add_field(&buffer, "event", event, event_length);
+  if (id)
+    sse_add_field(&buffer, "id", id, id_length);
+  if (retry)
+    sse_add_field(&buffer, "retry", retry, strlen(retry));
+  if (data)
+    sse_add_field(&buffer, "data", data, data_length);
+  luaL_addchar(&buffer, '\n');
+  luaL_pushresult(&buffer);
+  return 1;
+}
+
+static int f_sse_comment(lua_State* L) {
+  size_t length;
+  const char* comment = luaL_optlstring(L, 1, "", &length);
+  luaL_Buffer buffer;
+  luaL_buffinitsize(L, &buffer, length + 4);
+  sse_add_field(&buffer, "", comment, length);
+  luaL_addchar(&buffer, '\n');
+  luaL_pushresult(&buffer);
+  return 1;
+}
+
+static const luaL_Reg sse_lib[] = {
+  { "frame",     f_sse_frame            },
+  { "comment",   f_sse_comment          },
+  { NULL,        NULL }
+};
+
+// Request headers, kept as offsets into the raw request they came from; values only become strings when they're asked
+// for. Assignments go into a table of overrides, where `false` marks a header as removed.
+typedef struct { unsigned int name, name_length, value, value_length; } server_header_t;
+typedef struct { int count; server_header_t fields[]; } server_headers_t;
+
+static int server_header_line(const char* raw, size_t start, size_t end, server_header_t* field) {
+  size_t colon = start;
+  while (colon < end && raw[colon] != ':')
+    ++colon;
+  if (colon == start || colon == end)
+    return 0;
+  size_t value = colon + 1;
+  while (value < end && (raw[value] == ' ' || raw[value] == '\t'))
+    ++value;
+  if (field)
+    *field = (server_header_t){ start, colon - start, value, end - value };
+  return 1;
+}
+
+// Parses the request line of a raw request, and locates each of its headers. Returns the method, target, version,
+// headers, and the (1-based) offset of anything after the headers, or nothing if the request is malformed.
+static int f_headers_parse(lua_State* L) {
+  size_t length;
+  const char* raw = luaL_checklstring(L, 1, &length);
+  size_t end = 0, line = 0, count = 0;
+  while (end + 3 < length && memcmp(&raw[end], "\r\n\r\n", 4) != 0)
+    ++end;
+  if (end + 3 >= length)
+    return 0;
+  while (line < end && raw[line] != '\r')
+    ++line;
+  const char* method_end = memchr(raw, ' ', line);
+  const char* target_end = method_end ? memchr(method_end + 1, ' ', &raw[line] - (method_end + 1)) : NULL;
+  if (!method_end || method_end == raw || !target_end || target_end == method_end + 1 || target_end + 1 == &raw[line])
+    return 0;
+  for (size_t start = line + 2, i = start; i <= end; ++i) {
+    if (i == end || raw[i] == '\r') {
+      count += server_header_line(raw, start, i, NULL);
+      start = i + 2;
+      ++i;
+    }
+  }
+  lua_pushlstring(L, raw, method_end - raw);
+  lua_pushlstring(L, method_end + 1, target_end - (method_end + 1));
+  lua_pushlstring(L, target_end + 1, &raw[line] - (target_end + 1));
+  server_headers_t* headers = lua_newuserdatauv(L, sizeof(server_headers_t) + count * sizeof(server_header_t), 2);
+  headers->count = 0;
+  for (size_t start = line + 2, i = start; i <= end; ++i) {
+    if (i == end || raw[i] == '\r') {
+      headers->count += server_header_line(raw, start, i, &headers->fields[headers->count]);
+      start = i + 2;
+      ++i;
+    }
+  }
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  luaL_setmetatable(L, "wtk.server.c.headers");
+  lua_pushinteger(L, end + 5);
+  return 5;
+}
+
+// Overrides are keyed on lowercased names, same as eagerly parsed headers are.
+static void server_push_lower(lua_State* L, int index) {
+  if (lua_type(L, index) != LUA_TSTRING) {
+    lua_pushvalue(L, index);
+    return;
+  }
+  size_t length;
+  const char* key = lua_tolstring(L, index, &length);
+  luaL_Buffer buffer;
+  char* lower = luaL_buffinitsize(L, &buffer, length);
+  for (size_t i = 0; i < length; ++i)
+    lower[i] = tolower(key[i]);
+  luaL_pushresultsize(&buffer, length);
+}
+
+// Looks up a header case-insensitively; if there's more than one, the last one wins.
+static int f_headers_index(lua_State* L) {
+  server_headers_t* headers = luaL_checkudata(L, 1, "wtk.server.c.headers");
+  if (lua_getiuservalue(L, 1, 2) == LUA_TTABLE) {
+    server_push_lower(L, 2);
+    int type = lua_rawget(L, -2);
+    if (type != LUA_TNIL) {
+      if (type == LUA_TBOOLEAN && !lua_toboolean(L, -1))
+        lua_pushnil(L);
+      return 1;
+    }
+  }
+  size_t key_length = 0;
+  const char* key = lua_type(L, 2) == LUA_TSTRING ? lua_tolstring(L, 2, &key_length) : NULL;
+  lua_getiuservalue(L, 1, 1);
+  const char* raw = lua_tostring(L, -1);
+  for (int i = headers->count - 1; key && i >= 0; --i) {
+    server_header_t* field = &headers->fields[i];
+    if (field->name_length == key_length && strncasecmp(&raw[field->name], key, key_length) == 0) {
+      lua_pushlstring(L, &raw[field->value], field->value_length);
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int f_headers_newindex(lua_State* L) {
+  luaL_checkudata(L, 1, "wtk.server.c.headers");
+  if (lua_getiuservalue(L, 1, 2) != LUA_TTABLE) {
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, 1, 2);
+  }
+  server_push_lower(L, 2);
+  if (lua_isnil(L, 3))
+    lua_pushboolean(L, 0);
+  else
+    lua_pushvalue(L, 3);
+  lua_rawset(L, -3);
+  return 0;
+}
+
+// Iterating builds the same table of lowercased names that eagerly parsed headers would have been.
+static int f_headers_pairs(lua_State* L) {
+  server_headers_t* headers = luaL_checkudata(L, 1, "wtk.server.c.headers");
+  lua_getglobal(L, "next");
+  lua_createtable(L, 0, headers->count);
+  lua_getiuservalue(L, 1, 1);
+  const char* raw = lua_tostring(L, -1);
+  for (int i = 0; i < headers->count; ++i) {
+    server_header_t* field = &headers->fields[i];
+    luaL_Buffer buffer;
+    char* name = luaL_buffinitsize(L, &buffer, field->name_length);
+    for (unsigned int j = 0; j < field->name_length; ++j)
+      name[j] = tolower(raw[field->name + j]);
+    luaL_pushresultsize(&buffer, field->name_length);
+    lua_pushlstring(L, &raw[field->value], field->value_length);
+    lua_rawset(L, -4);
+  }
+  lua_pop(L, 1);
+  if (lua_getiuservalue(L, 1, 2) == LUA_TTABLE) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pushvalue(L, -2);
+      if (lua_isboolean(L, -2) && !lua_toboolean(L, -2))
+        lua_pushnil(L);
+      else
+        lua_pushvalue(L, -2);
+      lua_rawset(L, -6);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static const luaL_Reg headers_lib[] = {
+  { "parse",     f_headers_parse        },
+  { NULL,        NULL }
+};
+
 #define luaL_newclass(L, name, lib) lua_pushliteral(L, #name); luaL_newmetatable(L, "wtk.server.c." #name); luaL_setfuncs(L, lib, 0); lua_pushvalue(L, -1); lua_setfield(L, -2, "__index"); lua_rawset(L, -3);
 
 int luaopen_wtk_server_c(lua_State* L) {
@@ -409,6 +838,28 @@ int luaopen_wtk_server_c(lua_State* L) {
   luaL_newclass(L, socket, server_socket_lib);
   luaL_newclass(L, sha1, sha1_lib);
   luaL_newclass(L, base64, base64_lib);
+  luaL_newclass(L, websocket, websocket_lib);
+  luaL_newclass(L, sse, sse_lib);
+  luaL_newclass(L, headers, headers_lib);
+  for (int i = 0; i < 64; ++i)
+    base64_decode[(unsigned char)base64_encode[i]] = i;
+  // routines are registered in `wtk.c.offload`; the pool won't run anything else.
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, "wtk.c.offload");
+  lua_newtable(L);
+  for (int i = 0; server_offloads[i].name; ++i) {
+    lua_pushlightuserdata(L, (void*)&server_offloads[i]);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -4);
+    lua_pushlightuserdata(L, (void*)&server_offloads[i]);
+    lua_setfield(L, -2, server_offloads[i].name);
+  }
+  lua_setfield(L, -3, "offload");
+  lua_pop(L, 1);
+  luaL_getmetatable(L, "wtk.server.c.headers");
+  lua_pushcfunction(L, f_headers_index); lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, f_headers_newindex); lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, f_headers_pairs); lua_setfield(L, -2, "__pairs");
+  lua_pop(L, 1);
   return 1;
 }
 
@@ -5,7 +5,24 @@ local system = wtk.system
 local socket, sha1, base64 = driver.socket, driver.sha1, driver.base64
 local PACKET_SIZE = 4096
 
+local has_z, z = pcall(require, "wtk.z.c")
+local has_metrics, metrics = pcall(require, "wtk.metrics.c")
+local has_profiler, profiler = pcall(require, "wtk.profiler.c")
+
 local function merge(t1, t2) local t = {} for k,v in pairs(t1) do t[k] = v end for k,v in pairs(t2) do t[k] = v end return t end
+local function header(headers, name)
+  if headers[name] then return headers[name], name end
+  for key, value in pairs(headers) do if key:lower() == name then return value, key end end
+end
+-- Adds Accept-Encoding to the Vary header, keeping anything that's already there.
+local function vary_encoding(headers)
+  local vary, key = header(headers, 'vary')
+  if not vary then 
+    headers['vary'] = 'Accept-Encoding' 
+  elseif not vary:lower():find("accept%-encoding") then 
+    headers[key] = vary .. ", Accept-Encoding" 
+  end
+end
 local Server = { Socket = driver.socket, sha1 = driver.sha1, base64 = driver.base64 }
 Server.__index = Server
 
@@ -18,20 +35,10 @@ function Server.Websocket:handshake(request)
   request:respond(101, { Upgrade = "websocket", Connection = "Upgrade", ["Sec-WebSocket-Accept"] = base64.encode(sha1.binary(request.headers["sec-websocket-key"] .. "258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) })
   return self
 end
+function Server.Websocket.frame(message, opcode) return driver.websocket.frame(message, opcode or Server.Websocket.op.TEXT) end
+-- once upgraded, every frame goes through the client's outbound queue, so writes from the handler, hub frames and pongs can never interleave on the socket
 function Server.Websocket:write(message, opcode)
-  if not opcode then opcode = Server.Websocket.op.TEXT end
-  local fin, rsv1, rsv2, rsv3, opcode, masked = 1, 0, 0, 0, Server.Websocket.op.TEXT, 0
-  local first_byte = ((fin << 7) | (rsv1 << 6) | (rsv2 << 5) | (rsv3 << 4)) | opcode
-  local t = { string.pack("I1", first_byte) }
-  if #message <= 125 then
-    table.insert(t, string.pack("!1>I1", (masked << 7) | #message))
-  elseif #message <= 65535 then
-    table.insert(t, string.pack("!1>I1I2", (masked << 7) | 126, #message))
-  else
-    table.insert(t, string.pack("!1>I1I8", (masked << 7) | 127, #message))
-  end
-  table.insert(t, message)
-  self.client:write_block(table.concat(t))
+  return self.client:queue(Server.Websocket.frame(message, opcode))
 end
 function Server.Websocket:read()
   local accumulator, original_opcode = ""
@@ -53,7 +60,7 @@ function Server.Websocket:read()
     for i = 1, #encoded do table.insert(decoded, string.char(encoded:byte(i) ~ mask:byte(((i - 1) % 4) + 1))) end
     accumulator = table.concat(decoded)
     if opcode == Server.Websocket.op.PING then 
-      self:write_block(Server.Websocket.op.PONG, accumulator)
+      self:write(accumulator, Server.Websocket.op.PONG)
       accumulator, original_opcode = "", nil
     elseif opcode == Server.Websocket.op.CLOSE then
       self.client:close()
@@ -66,18 +73,35 @@ function Server.Websocket:read()
 end
 
 
+-- Server-sent events; output goes through the client's outbound queue, so streams can be subscribed to a `Server.Hub`.
+Server.EventStream = { }
+Server.EventStream.__index = Server.EventStream
+function Server.EventStream.new(client) return setmetatable({ client = client }, Server.EventStream) end
+function Server.EventStream.frame(data, event, id, retry) return driver.sse.frame(data, event, id, retry) end
+function Server.EventStream:send(data, event, id, retry) return self.client:queue(driver.sse.frame(data, event, id, retry)) end
+function Server.EventStream:write(frame) return self.client:queue(frame) end
+function Server.EventStream:comment(text) return self.client:queue(driver.sse.comment(text)) end
+function Server.EventStream:close() self.client:close() end
+
+
 Server.Response = { }
 Server.Response.__index = Server.Response
 function Server.Response.new(code, headers, body) return setmetatable({ code = code, headers = headers or {}, body = body }, Server.Response) end
+-- Serializing never yields, so every response can share the same table of parts.
+local parts = {}
+function Server.Response:serialize_header(client)
+  for i = #parts, 1, -1 do parts[i] = nil end
+  parts[1] = string.format("%s %d %s\r\n", "HTTP/1.1", self.code, client.server.codes[self.code])
+  if self.body and type(self.body) ~= 'function' and not self.headers['content-length'] and self.headers['transfer-encoding'] ~= 'chunked' then self.headers['content-length'] = #self.body end
+  if not self.headers['connection'] or self.headers['connection']:find("^%s*$") then self.headers['connection'] = client.server.drained and 'close' or 'keep-alive' end
+  if not self.headers['date'] or self.headers['date']:find("^%s*$") then self.headers['date'] = os.date("!%a, %d %b %Y %H:%M:%S GMT") end
+  for key,value in pairs(self.headers) do parts[#parts + 1] = string.format("%s: %s\r\n", key, value) end
+  parts[#parts + 1] = "\r\n"
+  return table.concat(parts)
+end
 function Server.Response:write_header(client)
   if client.closed then return end
-  local parts = { string.format("%s %d %s\r\n", "HTTP/1.1", self.code, client.server.codes[self.code]) }
-  if self.body and type(self.body) == 'string' and not self.headers['content-length'] and self.headers['transfer-encoding'] ~= 'chunked' then self.headers['content-length'] = #self.body end
-  if not self.headers['connection'] or self.headers['connection']:find("^%s*%") then self.headers['connection'] = 'keep-alive' end
-  if not self.headers['date'] or self.headers['date']:find("^%s*%") then self.headers['date'] = os.date("!%a, %d %b %Y %H:%M:%S GMT") end
-  for key,value in pairs(self.headers) do table.insert(parts, string.format("%s: %s\r\n", key, value)) end
-  table.insert(parts, "\r\n")
-  client:write_block(table.concat(parts))
+  client:write_block(self:serialize_header(client))
 end
 
 function Server.Response:write_encoded(client, chunk)
@@ -91,10 +115,46 @@ function Server.Response:write_encoded(client, chunk)
   return chunk and #chunk
 end
 
-function Server.Response:write(client)
+-- Transparently gzips the body if the client accepts it, and the content type is one the server is configured to compress.
+function Server.Response:compress(client, request)
+  local options = client.server.compression
+  if self.code ~= 200 or not self.body or type(self.body) == 'userdata' or header(self.headers, 'content-encoding') or header(self.headers, 'content-range') then return end
+  if not client.server:compressible(header(self.headers, 'content-type')) then return end
+  vary_encoding(self.headers)
+  if not request:accepts("gzip") then return end
+  if type(self.body) == 'string' then
+    if #self.body < options.min_size then return end
+    self.body = client.server:gzip(self.body)
+  else
+    local source, stream = self.body, z:open("gzip", options)
+    self.body = function()
+      while stream do
+        local chunk = source()
+        if not chunk then 
+          chunk, stream = stream:close(), nil 
+          return chunk 
+        end
+        chunk = stream:send(chunk)
+        if #chunk > 0 then return chunk end
+      end
+    end
+    self.headers['transfer-encoding'] = 'chunked'
+  end
+  local _, key = header(self.headers, 'content-length')
+  if key then self.headers[key] = nil end
+  self.headers['content-encoding'] = 'gzip'
+end
+
+function Server.Response:write(client, request)
   if client.closed then return end
-  self:write_header(client)
-  if self.body then 
+  if request then request.status = self.code end
+  if request and client.server.compression then self:compress(client, request) end
+  if request and request.cache_ttl and self.code == 200 and type(self.body) == 'string' and not header(self.headers, 'set-cookie') then
+    local bytes = self:serialize_header(client) .. self.body
+    client.server.cache:set(client.server.cache:key(request), bytes, request.cache_ttl)
+    client:write_block(bytes)
+  elseif self.body then
+    self:write_header(client)
     if type(self.body) == 'function' then
       for chunk in self.body do
         if #chunk > 0 then
@@ -109,6 +169,8 @@ function Server.Response:write(client)
     else
       self:write_encoded(client, self.body)
     end
+  else
+    self:write_header(client)
   end
   self:write_encoded(client, '') -- for chunked
   if self.code ~= 101 and not self.headers['content-length'] and self.headers['transfer-encoding'] ~= 'chunked' then client:close() end
@@ -125,10 +187,21 @@ local Request = { }
 Server.Request = Request
 Request.__index = Request
 function Request.new(client) 
-  return setmetatable({ method = nil, client = client, path = nil, version = nil, headers = {}, buffer = {}, cookies = {}, responded = false, length_read = 0 }, Request) 
+  return setmetatable({ method = nil, client = client, path = nil, version = nil, headers = {}, buffer = {}, cookies = {}, params = {}, responded = false, length_read = 0 }, Request) 
+end
+-- Readies a pooled request for the next one on the same connection, keeping its tables (and their allocated sizes).
+function Request:reset()
+  local client, headers, buffer, cookies, params = self.client, self.headers, self.buffer, self.cookies, self.params
+  for key in pairs(self) do self[key] = nil end
+  if type(headers) == 'table' then for key in pairs(headers) do headers[key] = nil end end
+  for key in pairs(cookies) do cookies[key] = nil end
+  for key in pairs(params) do params[key] = nil end
+  for i = #buffer, 1, -1 do buffer[i] = nil end
+  self.client, self.headers, self.buffer, self.cookies, self.params, self.responded, self.length_read = client, headers, buffer, cookies, params, false, 0
+  return self
 end
-function Request:parse_form(form)
-  local params = {}
+function Request:parse_form(form, params)
+  params = params or {}
   for key,value in form:gmatch("([^=&%?]+)=([^&]+)") do 
     value = value:gsub("%%([a-fA-F0-9][a-fA-F0-9])", function(e) return string.char(tonumber(e, 16)) end) 
     if params[key] then 
@@ -153,12 +226,20 @@ function Request:parse_headers()
       return nil
     end
   end
-  local headers, remainder
-  self.method, self.path, self.version, headers, remainder = table.concat(self.buffer):match("^(%S+) (%S+) (%S+)\r\n(.-\r\n)\r\n(.*)$")
-  self.params, self.path, self.search = {}, self.path:match("^([^?]+)(%??[^?]*)$")
-  assert(self.method and self.path, "malformed request")
-  if self.search then self.params = self:parse_form(self.search) end
-  for key,value in headers:gmatch("([^%:]+):%s*(.-)\r\n") do self.headers[key:lower()] = value end
+  local raw, headers, remainder = #self.buffer == 1 and self.buffer[1] or table.concat(self.buffer)
+  if self.client.server.lazy_headers then
+    local offset
+    self.method, self.path, self.version, headers, offset = driver.headers.parse(raw)
+    assert(self.method, "malformed request")
+    self.headers, remainder = headers, offset <= #raw and raw:sub(offset) or ""
+  else
+    self.method, self.path, self.version, headers, remainder = raw:match("^(%S+) (%S+) (%S+)\r\n(.-\r\n)\r\n(.*)$")
+    assert(self.method, "malformed request")
+    for key,value in headers:gmatch("([^%:]+):%s*(.-)\r\n") do self.headers[key:lower()] = value end
+  end
+  self.path, self.search = self.path:match("^([^?]+)(%??[^?]*)$")
+  assert(self.path, "malformed request")
+  self.params = self:parse_form(self.search, self.params)
   for key,value in (self.headers.cookie or ""):gmatch("([^=;%s]+)=([^;]+)") do self.cookies[key] = value:gsub("%%([a-fA-F0-9][a-fA-F0-9])", function(e) return string.char(tonumber(e, 16)) end) end
   if #remainder > 0 then self.client.buffer = remainder end
   assert(self.method ~= "POST" or self.headers['content-length'], "malformed request, requires content-length")
@@ -169,6 +250,16 @@ function Request:websocket()
   self.client.websocket = Server.Websocket.new(self.client):handshake(self)
   return self.client.websocket
 end
+function Request:sse(options)
+  self.responded, self.client.upgraded = true, true
+  -- the header goes out through the outbound queue too, as its first chunk, so events and hub frames can't interleave with it
+  local response = Server.Response.new(200, merge({ ['content-type'] = 'text/event-stream', ['cache-control'] = 'no-cache', ['x-accel-buffering'] = 'no' }, options and options.headers or {}))
+  self.client:queue(response:serialize_header(self.client))
+  self.client:flush()
+  local stream = Server.EventStream.new(self.client)
+  if not options or options.keepalive ~= false then self.client.server:keepalive(stream) end
+  return stream
+end
 function Request:body() 
   if (self.method ~= "POST" and self.method ~= "PUT") or self._body then 
     return self._body 
@@ -197,24 +288,41 @@ function Request:respond(code, headers, body)
     for key,value in pairs(self.cookies) do table.insert(cookies, key .. "=" .. tostring(value):gsub("[%c:/?#%[%]@!$&'\"%(%)*+,;=%%]", function(e) return "%" .. string.format("%02x", e:byte(1)) end)) end
     if #cookies > 0 then headers['set-cookie'] = table.concat(cookies, ';') end
   end
-  local res = (type(code) == 'table' and getmetatable(code) == Server.Response and code or Server.Response.new(code, headers, body))
-  res:write(self.client)
+  local res = type(code) == 'table' and getmetatable(code) == Server.Response and code
+  if not res and self.client.server.pool then
+    res = self.client.response or Server.Response.new()
+    self.client.response, res.code, res.headers, res.body = res, code, headers or {}, body
+  end
+  res = res or Server.Response.new(code, headers, body)
+  res:write(self.client, self)
   return res
 end
+-- Marks the response to this request as cacheable for `ttl` seconds; subsequent matching requests are served without running the handler.
+function Request:cache(ttl)
+  local cache = self.client.server.cache
+  if cache and (self.method == "GET" or self.method == "HEAD") then self.cache_ttl = ttl or cache.ttl end
+  return self
+end
+function Request:accepts(encoding)
+  local accept = self.headers['accept-encoding']
+  return accept and accept:find(encoding, 1, true) and not accept:find(encoding .. "%s*;%s*q=0%.?0*%f[^%d]") and true or false
+end
 function Request:redirect(path) return self:respond(302, { ["location"] = path }) end
 function Request:file(path, headers)
   assert(not path:find("%.%."), "invalid path") 
-  if not wtk.system.stat(path) then
-    return self:respond(200, merge({ ['content-type'] = self.client.server:mimetype(path) }, headers or {}), assert(packed[path], { code = 404 }))
-  end
-  local stat = assert(wtk.system.stat(path), { code = 404 })
+  local stat = self.client.server:stat(path)
+  if not stat then return self:packed(path, headers) end
   assert(stat.type == "file", { code = 404 })
-  local s, e = 0, stat.size
-  if self.headers['range'] then
-    local hs, he = self.headers['range']:match("(%d*)%-(%d*)")
-    s, e = tonumber(hs), he ~= "" and tonumber(he) or stat.size
-  end
+  local s, e = self:range(stat.size)
   headers = merge({ ['last-modified'] = os.date("%a, %d %b %Y %H:%M:%S GMT", stat.mtime), ['content-length'] = e - s, ['accept-ranges'] = 'bytes', ['content-type'] = self.client.server:mimetype(path), ["cache-control"] = not self.client.server.debug and "max-age=86400" or nil }, headers or {})
+  local server = self.client.server
+  if server.compression and not self.headers['range'] and stat.size >= server.compression.min_size and stat.size <= server.compression.max_file_size and 
+    server:compressible(headers['content-type']) and self:accepts("gzip") then
+    local body = server:precompressed(path, stat)
+    headers['content-length'], headers['content-encoding'] = #body, 'gzip'
+    vary_encoding(headers)
+    return self:respond(200, headers, body)
+  end
   local f = assert(wtk.io.file(path, "rb"), { code = 404 })
   if self.headers['range'] then
     headers['content-range'] = string.format("bytes %d-%d/%d", s, e - 1, stat.size)
@@ -228,6 +336,44 @@ function Request:file(path, headers)
     return chunk
   end) 
 end
+-- The byte range asked for in a file of `size` bytes, as an offset and an end offset, exclusive; the whole file if there's
+-- no range, or it spans more than one. Raises a 416 if it lies outside the file.
+function Request:range(size)
+  local hs, he = (self.headers['range'] or ""):match("^%s*bytes%s*=%s*(%d*)%s*%-%s*(%d*)%s*$")
+  if not hs or (hs == "" and he == "") then return 0, size end
+  local s, e
+  if hs == "" then
+    s, e = math.max(size - tonumber(he), 0), size
+  else
+    s, e = tonumber(hs), he ~= "" and math.min(tonumber(he) + 1, size) or size
+  end
+  assert(s < e and s < size, { code = 416 })
+  return s, e
+end
+-- Serves a file packed into the binary, straight out of it. Its ETag is worked out when it's packed; names with a hash in
+-- them, like `app.3fa9c2d1.js`, are cached forever. Clients that take gzip get the packed gzipped copy, if there is one.
+function Request:packed(path, headers)
+  local asset = assert(packed and packed[path], { code = 404 })
+  local server = self.client.server
+  local cache_control = path:find("[%.%-_]%x%x%x%x%x%x%x%x+%.%w+$") and "public, max-age=31536000, immutable" or "max-age=86400"
+  headers = merge({ ['etag'] = asset.etag, ['cache-control'] = not server.debug and cache_control or nil }, headers or {})
+  if asset.gzip then vary_encoding(headers) end
+  local match = self.headers['if-none-match']
+  if asset.etag and match and (match:find(asset.etag, 1, true) or match:find("^%s*%*%s*$")) then return self:respond(304, headers) end
+  headers['content-type'], headers['accept-ranges'] = headers['content-type'] or server:mimetype(path), 'bytes'
+  if self.headers['range'] and (not self.headers['if-range'] or self.headers['if-range'] == asset.etag) then
+    local s, e = self:range(#asset)
+    if e - s < #asset then
+      headers['content-range'] = string.format("bytes %d-%d/%d", s, e - 1, #asset)
+      return self:respond(206, headers, asset:slice(s + 1, e))
+    end
+  end
+  if asset.gzip and self:accepts("gzip") then
+    headers['content-encoding'] = 'gzip'
+    return self:respond(200, headers, asset.gzip)
+  end
+  return self:respond(200, headers, asset)
+end
 function Request:attachment(path, headers) return self:file(path, merge(headers or {}, { ["Content-Disposition"] = "attachment; filename=\"" .. path:gsub(".*/", ""):gsub("\"", "") .. "\"" })) end
 function Request:parts()
   local boundary = self.headers['content-type']:match("multipart/form-data;%s+boundary=(.+)$")
@@ -275,25 +421,84 @@ function Request:parts()
   end
 end
 
+-- An LRU cache of fully serialized responses, keyed on method, path, query, and the configured `vary` request headers.
+Server.Cache = {}
+Server.Cache.__index = Server.Cache
+function Server.Cache.new(options)
+  local self = setmetatable(merge({ max_bytes = 64*1024*1024, ttl = 60, vary = { "accept-encoding" }, entries = {}, bytes = 0 }, options or {}), Server.Cache)
+  self.head = { }
+  self.head.next, self.head.prev = self.head, self.head
+  return self
+end
+function Server.Cache:key(request)
+  local parts = { request.method, request.path, request.search or "" }
+  for _, name in ipairs(self.vary) do table.insert(parts, request.headers[name] or "") end
+  -- whatever `vary` is set to, compressed and uncompressed responses can't share an entry.
+  if request.client.server.compression then table.insert(parts, request:accepts("gzip") and "gzip" or "identity") end
+  return table.concat(parts, "\n")
+end
+function Server.Cache:unlink(entry)
+  entry.prev.next, entry.next.prev = entry.next, entry.prev
+  return entry
+end
+function Server.Cache:link(entry)
+  entry.prev, entry.next = self.head, self.head.next
+  self.head.next.prev, self.head.next = entry, entry
+  return entry
+end
+function Server.Cache:remove(entry)
+  self:unlink(entry)
+  self.entries[entry.key] = nil
+  self.bytes = self.bytes - #entry.bytes
+end
+function Server.Cache:get(key)
+  local entry = self.entries[key]
+  if not entry then return nil end
+  if entry.expires <= system.time() then return nil end
+  self:link(self:unlink(entry))
+  return entry.bytes
+end
+function Server.Cache:set(key, bytes, ttl)
+  if self.entries[key] then self:remove(self.entries[key]) end
+  if #bytes > self.max_bytes then return end
+  self.entries[key] = self:link({ key = key, bytes = bytes, expires = system.time() + (ttl or self.ttl) })
+  self.bytes = self.bytes + #bytes
+  while self.bytes > self.max_bytes do self:remove(self.head.prev) end
+end
+function Server.Cache:clear()
+  self.entries, self.bytes = {}, 0
+  self.head.next, self.head.prev = self.head, self.head
+end
+
 local Client = {}
 Client.__index = Client
-function Client.new(server, socket) return setmetatable({ last_activity = os.time(), server = server, waiting = nil, socket = socket, responsed = false, peer = select(4, socket:peer()) }, Client) end
-function Client:write(buf) 
+function Client.new(server, socket) return setmetatable({ last_activity = os.time(), server = server, waiting = nil, socket = socket, responsed = false, peer = select(4, socket:peer()), yields = {} }, Client) end
+-- Readies a pooled client for a new connection; it keeps its spare request and response.
+function Client:reset(socket)
+  local server, yields, spare, response = self.server, self.yields, self.spare, self.response
+  for key in pairs(self) do self[key] = nil end
+  for key in pairs(yields) do yields[key] = nil end
+  self.last_activity, self.server, self.socket, self.responsed, self.peer, self.yields, self.spare, self.response = os.time(), server, socket, false, select(4, socket:peer()), yields, spare, response
+  return self
+end
+function Client:write(buf, offset) 
   self.last_activity = os.time() 
-  return self.socket:send(buf) 
+  local len, err = self.socket:send(buf, offset) 
+  if len and self.server.metrics then self.server.metrics.sent:inc(len) end
+  return len, err
 end
+-- Writes all of a string, or a view, which is never copied.
 function Client:write_block(buf)
-  while #buf > 0 do
-    local len, err = self:write(buf)
+  local offset = 0
+  while offset < #buf do
+    local len, err = self:write(buf, offset)
     if not len and err == "timeout" then 
       self:yield("write") 
     elseif not len and (err == "reset" or err == "pipe") then
       self.closed = true
       break
-    elseif len and len >= #buf then
-      break
     elseif len then
-      buf = buf:sub(len + 1)
+      offset = offset + len
     else
       error({ code = 500, message = "Error writing to socket: " .. err })
     end
@@ -313,7 +518,10 @@ function Client:read(len)
   end
   while not self.closed do
     local packet, err = self.socket:recv(len) 
-    if packet and #packet > 0 then return packet end
+    if packet and #packet > 0 then 
+      if self.server.metrics then self.server.metrics.received:inc(#packet) end
+      return packet 
+    end
     if err == "timeout" then
       self:yield()
     elseif err == "closed" or err == "reset" or err == "pipe" then
@@ -323,16 +531,113 @@ function Client:read(len)
     end
   end
 end
-function Client:close() self.server.log:verbose("Manually closing connnection.") self.socket:close() self.closed = true end
-function Client:yield(type) coroutine.yield({ socket = self.socket, type = type or "read" }) end
+-- Queues a pre-encoded chunk to be sent whenever the socket is writable; used for fan-out, where the
+-- same string is shared between every subscriber. Bounded by `server.max_queue`, with `server.queue_policy`
+-- deciding what happens to slow consumers: "drop_oldest", "drop_newest", or "close".
+function Client:queue(chunk)
+  if self.closed then return false end
+  local queue = self.outbound
+  if not queue then queue = { offset = 0, bytes = 0 } self.outbound = queue end
+  if #queue >= self.server.max_queue then
+    local policy = self.server.queue_policy
+    if policy == "close" then 
+      self.server.log:verbose("Closing slow consumer %s.", self.peer)
+      self:close() 
+      return false 
+    end
+    self.dropped = (self.dropped or 0) + 1
+    if policy == "drop_newest" then return false end
+    -- never drop a partially sent chunk
+    local index = queue.offset > 0 and 2 or 1
+    if queue[index] then queue.bytes = queue.bytes - #table.remove(queue, index) end
+  end
+  queue[#queue + 1] = chunk
+  queue.bytes = queue.bytes + #chunk
+  self.server:schedule(self)
+  return true
+end
+function Client:flush()
+  local queue = self.outbound
+  while queue and #queue > 0 and not self.closed do
+    local written, err = self.socket:sendv(queue)
+    if written then
+      queue.bytes = queue.bytes - written
+      if self.server.metrics then self.server.metrics.sent:inc(written) end
+      self.last_activity = os.time()
+    elseif err == "timeout" then
+      if not self.writer then self.writer = assert(self.socket:dup()) end
+      if not self.writing then
+        self.writing = true
+        self.server.loop:add(self.writer, function() self:flush() end, "write")
+      end
+      return false
+    else
+      self:close()
+    end
+  end
+  if self.writing then
+    self.writing = false
+    self.server.loop:rm(self.writer)
+  end
+  return true
+end
+function Client:close() 
+  self.server.log:verbose("Manually closing connnection.") 
+  if self.writing then self.writing = false self.server.loop:rm(self.writer) end
+  if self.writer then self.writer:close() end
+  self:unwatch()
+  self.socket:close() 
+  self.closed = true 
+end
+function Client:yield(type)
+  type = type or "read"
+  if not self.yields[type] then self.yields[type] = { socket = self.socket, type = type } end
+  coroutine.yield(self.yields[type])
+  wtk.Loop.check()
+end
+-- With `cancel_on_disconnect`, the connection's job is cancelled if the peer hangs up while a request is being handled;
+-- a duplicate of the socket is watched, edge-triggered, so that it doesn't get in the way of whatever the job waits on.
+function Client:watch()
+  if self.watcher then return end
+  self.watcher = assert(self.socket:dup())
+  self.server.loop:add(self.watcher, function()
+    if self.handling and self.job and not self.job.finished and self.socket:closed() then self.server.loop:cancel(self.job, { code = 499, message = "Client disconnected.", verbose = true }) end
+  end, "read", true)
+end
+function Client:unwatch()
+  if self.watcher then
+    self.server.loop:rm(self.watcher)
+    self.watcher:close()
+    self.watcher = nil
+  end
+end
 
 function Server.new(t) 
   t.socket = assert(socket.bind(t.host or "0.0.0.0", t.port or (t.debug and 8080 or 80)), "unable to bind")
   t.mimes = { ["svg"] = "image/svg+xml", ["jpeg"] = "image/jpeg", ["jpg"] = "image/jpeg", ["png"] = "image/png", ["gif"] = "image/gif", ["js"] = "text/javascript", ["html"] = "text/html", ["css"] = "text/css", ["txt"] = "text/plain" }
-  t.codes = { [101] = "Switching Protocols", [200] = "OK", [201] = "Created", [204] = "No Content", [206] = "Partial Content", [301] = "Moved Permanently", [302] = "Found", [400] = "Bad Request", [403] = "Forbidden", [404] = "Not Found", [500] = "Internal Server Error" }
+  t.codes = { [101] = "Switching Protocols", [200] = "OK", [201] = "Created", [204] = "No Content", [206] = "Partial Content", [301] = "Moved Permanently", [302] = "Found", [304] = "Not Modified", [400] = "Bad Request", [403] = "Forbidden", [404] = "Not Found", [409] = "Conflict", [416] = "Range Not Satisfiable", [499] = "Client Closed Request", [500] = "Internal Server Error", [503] = "Service Unavailable", [504] = "Gateway Timeout" }
   t.routes = { GET = { }, POST = { }, PUT = { }, DELETE = { } }
+  t.max_queue = t.max_queue or 256
+  t.queue_policy = t.queue_policy or "drop_oldest"
+  t.flushing = { }
+  t.flights = { }
+  t.clients = { }
+  if t.stat_cache then t.stat_cache = { size = type(t.stat_cache) == 'number' and t.stat_cache or 4096, stats = {}, dirs = {}, count = 0 } end
+  if t.pool then t.pool = { size = type(t.pool) == 'table' and t.pool.size or 256, clients = {} } end
+  t.keepalive_interval = t.keepalive_interval or 15
+  if t.cache then t.cache = Server.Cache.new(t.cache ~= true and t.cache or nil) end
+  if t.compression then
+    assert(has_z, "compression requires wtk.z.c")
+    t.compression = merge({ level = 1, min_size = 1024, max_file_size = 4*1024*1024, offload_size = 256*1024, cache_size = 16*1024*1024, types = { "^text/", "javascript", "json", "xml" } }, t.compression == true and {} or t.compression)
+    t.compression.cache = { entries = {}, paths = {}, order = {}, bytes = 0 }
+  end
   local self = setmetatable(t, Server) 
-  self.log = t.log or Server.Log.new(t.verbose)
+  self.log = t.log or Server.Log.new(t.verbose, t.logging)
+  if t.metrics then
+    assert(has_metrics, "metrics requires wtk.metrics.c")
+    self.metrics = Server.Metrics.new(t.metrics ~= true and t.metrics or {})
+    if self.metrics.route then self:get(self.metrics.route, function(request) self.metrics:respond(request) end) end
+  end
   local type, address, port, peer = self.socket:peer()
   if type == "unix" then
     self.log:info("Server up at %s", address)
@@ -359,43 +664,182 @@ end
 Server.error_handler = Server.default_error_handler
 
 function Server:accept()
-  local socket = self.socket:accept()
+  local socket, err = self.socket:accept()
   if socket then 
-    local client = Client.new(self, socket)
-    self.log:verbose("Incoming connection from '%s'", select(4, socket:peer()))
+    local client = self.pool and table.remove(self.pool.clients)
+    client = client and client:reset(socket) or Client.new(self, socket)
+    self.log:verbose("Incoming connection from '%s'", client.peer)
+    if self.metrics then self.metrics.connections:inc() end
+    self.clients[client] = true
+    -- these are made once per connection, rather than once per request.
+    local request
+    local function handle()
+      request = (self.pool and client.spare and client.spare:reset() or Request.new(client)):parse_headers()
+      if request then client.request = request end
+      if request and self.pool then client.spare = request end
+      if request and self.metrics then request.started = system.time() end
+      if request and not self:cached(client, request) then
+        if self.cancel_on_disconnect then client:watch() end
+        client.handling = true
+        self:accepted(client, request)
+        if not request.responded then error({ code = 404 }) end
+      end
+    end
+    local function report(err) self.log:error("Error in error handler: %s\n%s", err.error, err.stack) end
+    local function handle_error(err) try(function() self:error_handler(request, err.error, client, err) end, report) end
     client.job = self.loop:job(function()
       while not client.closed do
-        local request
-        try(function()
-          request = Request.new(client):parse_headers()
-          if request then
-            self:accepted(client, request)
-            if not request.responded then error({ code = 404 }) end
-          end
-        end, function(err)
-          try(function()
-            self:error_handler(request, err.error, client, err)
-          end, function(err)
-            self.log:error("Error in error handler: %s\n%s", err.error, err.stack)
-          end)
-        end)
+        request, client.handling = nil, false
+        try(handle, handle_error)
+        if request and request.flight then self:land(request.flight) end
+        if request and self.metrics then self.metrics:record(request) end
         -- clear out buffer if it wasn't read
         if request then request:body() end
+        if self.drained and not client.closed then client:close() end
+      end
+      client:unwatch()
+      self:forget(client)
+      -- only clients nothing else could still be holding onto go back in the pool.
+      if self.pool and not client.upgraded and not client.websocket and not client.outbound and #self.pool.clients < self.pool.size then
+        table.insert(self.pool.clients, client)
       end
     end)
+    client.job.client = client
+    -- a cancelled job that doesn't unwind in one step is closed, without getting to the end of the function above.
+    client.job:fail(function()
+      if not client.closed then client:close() end
+      client:unwatch()
+      self:forget(client)
+    end)
     return client
+  elseif err ~= "timeout" then
+    self.log:error("Error accepting client: %s", err)
+  end
+end
+function Server:forget(client)
+  self.clients[client] = nil
+  if self.metrics then self.metrics.connections:dec() end
+  if self.drained and not next(self.clients) then self.drained:resolve() end
+end
+-- Expired entries are left in the cache until evicted; if we have one, then only the first request to miss it
+-- runs the handler, and everyone else waits to see if it refills the cache.
+function Server:cached(client, request)
+  if not self.cache or (request.method ~= "GET" and request.method ~= "HEAD") then return false end
+  local key = self.cache:key(request)
+  local bytes = self.cache:get(key)
+  if not bytes and self.cache.entries[key] then
+    if self.flights[key] and coroutine.isyieldable() then
+      coroutine.yield({ promise = self.flights[key] })
+      bytes = self.cache:get(key)
+    elseif not self.flights[key] then
+      request.flight, self.flights[key] = key, wtk.Promise.new()
+    end
+  end
+  if not bytes then return false end
+  request.responded, request.route, request.status = true, "cached", 200
+  client:write_block(bytes)
+  self.log:verbose("RES cached %s", client.peer)
+  return true
+end
+-- Single-flight; only one coroutine at a time runs `func` for a given key. Anyone else who asks for the same key
+-- in the meantime is parked until it finishes, and then gets the same results, or error.
+function Server:flight(key, func)
+  local flight = self.flights[key]
+  local results
+  if flight and coroutine.isyieldable() then
+    coroutine.yield({ promise = flight })
+    results = flight.resolved[1]
   else
-    log:error("Error accepting client.")
+    flight = wtk.Promise.new()
+    self.flights[key] = flight
+    results = table.pack(pcall(func))
+    self.flights[key] = nil
+    flight:resolve(results)
   end
+  if not results[1] then error(results[2], 0) end
+  return table.unpack(results, 2, results.n)
+end
+function Server:land(key)
+  local flight = self.flights[key]
+  self.flights[key] = nil
+  if flight then flight:resolve() end
 end
 function Server:add(loop)
   loop:add(self.socket, function() 
     self:accept()
   end, "read")
   self.loop = loop
+  if self.log.attach then self.log:attach(loop) end
+  if self.gc and loop.gc then loop:gc(self.gc ~= true and self.gc or nil) end
+  if self.metrics then self.metrics:probe(loop) end
+  if self.slow_threshold and loop.instrument then loop:instrument(self.slow_threshold, function(...) self:slow(...) end) end
   return self
 end
-function Server:stop(loop) self.loop:remove(self.socket) end
+-- Logs callbacks that held up the loop for longer than `slow_threshold`, with whatever request they were working on.
+function Server:slow(duration, fd, traceback, job)
+  local request = job and job.client and job.client.request
+  if not traceback and job and job.co and not job.finished then traceback = debug.traceback(job.co, "stack at yield:") end
+  self.log:warn("Slow callback: %.1fms%s%s%s", duration * 1000, fd and (" on fd " .. fd) or "", request and string.format(" handling %s %s", request.method, request.path) or "", traceback and ("\n" .. traceback) or "")
+end
+-- Batches up flushing of queued output until the next loop iteration, so that many publishes result in a single writev per client.
+function Server:schedule(client)
+  if not next(self.flushing) then
+    self.loop:add(function()
+      local clients = self.flushing
+      self.flushing = {}
+      for client in pairs(clients) do client:flush() end
+    end)
+  end
+  self.flushing[client] = true
+end
+-- Sends a comment down every open event stream on a single timer, to keep intermediaries from timing them out.
+function Server:keepalive(stream)
+  if not self.streams then
+    self.streams = setmetatable({}, { __mode = "k" })
+    self.keepalive_timer = wtk.io.countdown(self.keepalive_interval, self.keepalive_interval)
+    local comment = driver.sse.comment()
+    self.loop:add(self.keepalive_timer[0], function()
+      self.keepalive_timer:__read(8)
+      for stream in pairs(self.streams) do
+        if stream.client.closed then self.streams[stream] = nil else stream.client:queue(comment) end
+      end
+    end)
+  end
+  self.streams[stream] = true
+end
+-- Stops accepting connections. Any already waiting to be accepted are taken on first, rather than reset.
+function Server:stop()
+  if not self.stopped then
+    self.stopped = true
+    self.loop:rm(self.socket)
+    while self:accept() do end
+    self.socket:close()
+  end
+  return self
+end
+-- Stops accepting connections, and lets the requests in flight finish, closing their connections afterwards; idle
+-- keep-alive connections are closed straight away, and ones that haven't made a request yet are answered once, then
+-- closed. Anything still open after `timeout` seconds (by default, 30) is cancelled. Returns a promise that resolves
+-- once every connection is closed.
+function Server:drain(timeout)
+  if self.drained then return self.drained end
+  self.drained = wtk.Promise.new()
+  local reason = { code = 503, message = "Server draining.", verbose = true }
+  self:stop()
+  -- connections that haven't had a request yet, like the ones `stop` just took on, get to make one before closing.
+  for client in pairs(self.clients) do
+    if not client.handling and client.request then self.loop:cancel(client.job, reason) end
+  end
+  if not next(self.clients) then return self.drained:resolve() end
+  local timer = wtk.io.countdown(timeout or 30)
+  local function stop() if timer then self.loop:rm(timer[0]) timer:close() timer = nil end end
+  self.loop:add(timer[0], function()
+    stop()
+    self.log:warn("Draining timed out; cancelling the remaining connections.")
+    for client in pairs(self.clients) do self.loop:cancel(client.job, reason) end
+  end)
+  return self.drained:always(stop)
+end
 function Server:accepted(client, request)
   (self.handler or self.default_handler)(self, request)
 end
@@ -404,11 +848,45 @@ function Server:mimetype(file)
   return extension and self.mimes[extension] or "text/plain"
 end
 
+function Server:compressible(content_type)
+  if not content_type or not self.compression then return false end
+  for _, pattern in ipairs(self.compression.types) do if content_type:find(pattern) then return true end end
+  return false
+end
+
+-- Gzips a whole body. Bodies of at least `offload_size` are compressed on the loop's thread pool, when there's a job to wait in.
+function Server:gzip(body)
+  if #body >= self.compression.offload_size and self.loop and coroutine.isyieldable() then
+    return assert(self.loop:offload(z.offload.gzip, body, self.compression.level):await())
+  end
+  local stream = z:open("gzip", self.compression)
+  return stream:send(body) .. stream:close()
+end
+
+-- Caches gzipped static files, keyed by path and modification time; evicts the oldest entries once over `cache_size`.
+function Server:precompressed(path, stat)
+  local cache, key = self.compression.cache, path .. "@" .. stat.mtime
+  if cache.entries[key] then return cache.entries[key] end
+  local f = assert(wtk.io.file(path, "rb"), { code = 404 })
+  local body = self:gzip(f:read(stat.size) or "")
+  f:close()
+  local stale = cache.paths[path]
+  if stale and cache.entries[stale] then cache.bytes, cache.entries[stale] = cache.bytes - #cache.entries[stale], nil end
+  cache.entries[key], cache.paths[path], cache.bytes = body, key, cache.bytes + #body
+  table.insert(cache.order, key)
+  while cache.bytes > self.compression.cache_size and #cache.order > 1 do
+    local oldest = table.remove(cache.order, 1)
+    if cache.entries[oldest] then cache.bytes, cache.entries[oldest] = cache.bytes - #cache.entries[oldest], nil end
+  end
+  return body
+end
+
 function Server:default_handler(request)
   for i, route in pairs(self.routes[request.method] or {}) do
     local results = { request.path:match(route.path) }
     if results and #results > 0 then
       for i,v in ipairs(results) do if v == "" then results[i] = false end end
+      request.route = route.name
       return true, route.handler(request, table.unpack(results))
     end
   end
@@ -423,7 +901,7 @@ function Server:route(method, path, func)
         return
       end
     end
-    table.insert(self.routes[method], { path = target_path, handler = func }) 
+    table.insert(self.routes[method], { path = target_path, name = path, handler = func }) 
     table.sort(self.routes[method], function(a,b) 
       local _, counta = a.path:gsub("/", "")
       local _, countb = b.path:gsub("/", "")
@@ -444,30 +922,251 @@ function Server:post(path, func) return self:route("POST", path, func) end
 function Server:put(path, func) return self:route("PUT", path, func) end
 function Server:delete(path, func) return self:route("DELETE", path, func) end
 
+-- A simple pub/sub hub; messages are encoded once per protocol, and the resulting frame is shared between all subscribers.
+Server.Hub = {}
+Server.Hub.__index = Server.Hub
+function Server.Hub.new() return setmetatable({ channels = {} }, Server.Hub) end
+function Server.Hub:subscribe(channel, subscriber)
+  if not self.channels[channel] then self.channels[channel] = {} end
+  self.channels[channel][subscriber] = true
+  return self
+end
+function Server.Hub:unsubscribe(channel, subscriber)
+  if channel == nil then
+    for channel in pairs(self.channels) do self:unsubscribe(channel, subscriber) end
+  elseif self.channels[channel] then
+    self.channels[channel][subscriber] = nil
+    if not next(self.channels[channel]) then self.channels[channel] = nil end
+  end
+  return self
+end
+function Server.Hub:publish(channel, message, ...)
+  local subscribers, frames, delivered = self.channels[channel], {}, 0
+  if not subscribers then return 0 end
+  for subscriber in pairs(subscribers) do
+    if subscriber.client.closed then
+      subscribers[subscriber] = nil
+    else
+      local frame = frames[subscriber.frame]
+      if not frame then
+        frame = subscriber.frame(message, ...)
+        frames[subscriber.frame] = frame
+      end
+      if subscriber.client:queue(frame) then delivered = delivered + 1 end
+    end
+  end
+  if not next(subscribers) then self.channels[channel] = nil end
+  return delivered
+end
+
+-- Standard server metrics; the registry lives in shared memory, so if the server is created before forking workers, every
+-- worker records into, and `/metrics` reports, the same series. Per-process gauges are labelled with the pid.
+Server.Metrics = {}
+Server.Metrics.__index = Server.Metrics
+function Server.Metrics.new(options)
+  local registry = options.registry or metrics.new(options)
+  local self = setmetatable({ registry = registry, route = options.route, interval = options.interval or 1 }, Server.Metrics)
+  self.requests = registry:counter("wtk_http_requests_total", "Requests handled, by method, route and status.", { "method", "route", "status" })
+  self.durations = registry:histogram("wtk_http_request_duration_seconds", "Time from parsing request headers to finishing the response.", { "route" })
+  self.sent = registry:counter("wtk_http_sent_bytes_total", "Bytes written to clients."):labels()
+  self.received = registry:counter("wtk_http_received_bytes_total", "Bytes read from clients."):labels()
+  self.connections = registry:gauge("wtk_http_connections", "Open client connections."):labels()
+  self.lag = registry:gauge("wtk_loop_lag_seconds", "How late the most recent metrics probe timer fired.", { "pid" })
+  self.heap = registry:gauge("wtk_lua_heap_bytes", "Bytes allocated by the Lua heap.", { "pid" })
+  self.collections = registry:counter("wtk_lua_gc_cycles_total", "Completed garbage collection cycles, by whether the loop ran them while idle.", { "pid", "idle" })
+  self.collecting = registry:gauge("wtk_lua_gc_idle_seconds", "Total time the loop has spent collecting garbage while idle.", { "pid" })
+  return self
+end
+function Server.Metrics:record(request)
+  local route = request.route or "none"
+  self.requests:labels(request.method, route, request.status or 0):inc()
+  if request.started then self.durations:labels(route):observe(system.time() - request.started) end
+end
+-- Samples loop lag and heap size every `interval` seconds; called once the server is added to its loop, which is after forking.
+function Server.Metrics:probe(loop)
+  if self.timer then return end
+  local pid = system.pid()
+  self.lag, self.heap = self.lag:labels(pid), self.heap:labels(pid)
+  local idle, busy, collecting = self.collections:labels(pid, "true"), self.collections:labels(pid, "false"), self.collecting:labels(pid)
+  local last = loop.stats and loop:stats()
+  local expected = system.time() + self.interval
+  self.timer = wtk.io.countdown(self.interval, self.interval)
+  loop:add(self.timer[0], function()
+    self.timer:__read(8)
+    local now = system.time()
+    self.lag:set(math.max(now - expected, 0))
+    self.heap:set(collectgarbage("count") * 1024)
+    expected = now + self.interval
+    if last then
+      -- cycles are only counted once the loop has been asked to collect while idle; anyone resetting the stats restarts the deltas.
+      local stats = loop:stats()
+      local function delta(key) return stats[key] >= last[key] and stats[key] - last[key] or stats[key] end
+      idle:inc(delta("gc_idle_cycles"))
+      busy:inc(math.max(delta("gc_cycles") - delta("gc_idle_cycles"), 0))
+      collecting:inc(delta("gc_time"))
+      last = stats
+    end
+  end)
+end
+function Server.Metrics:respond(request)
+  if self.timer then self.heap:set(collectgarbage("count") * 1024) end
+  request:respond(200, { ["content-type"] = "text/plain; version=0.0.4" }, self.registry:expose())
+end
+
+
+-- Lines are formatted into an in-memory buffer, which once attached to a loop is written out with a single writev when the
+-- loop next comes around, rather than on every line. Without a loop, lines are written out as they come in.
 Server.Log = {}
 Server.Log.__index = Server.Log
-function Server.Log.new(verbose) return setmetatable({ _verbose = verbose }, Server.Log) end
-function Server.Log:log(type, message, ...) wtk.io.stdout:write(string.format("[%5s][%s.%03d]: " .. message .. "\n", type, os.date("%Y-%m-%dT%H:%M:%S"), (math.floor(wtk.system.time() * 1000.0) % 1000), ...)):flush() end
+local json_escapes = { ['"'] = '\\"', ['\\'] = '\\\\', ["\n"] = "\\n", ["\r"] = "\\r", ["\t"] = "\\t" }
+local function json_string(value) return '"' .. tostring(value):gsub('[%c"\\]', function(c) return json_escapes[c] or string.format("\\u%04x", c:byte()) end) .. '"' end
+function Server.Log.new(verbose, options)
+  options = options or {}
+  return setmetatable({
+    _verbose = verbose, stream = options.stream or wtk.io.stdout, format = options.format or "text", policy = options.policy or "drop",
+    max_bytes = options.max_bytes or 1024*1024, buffer = { offset = 0 }, bytes = 0, dropped = 0, stamp_ms = -1
+  }, Server.Log)
+end
+-- Only call os.date once a second, and only format the timestamp once a millisecond.
+function Server.Log:timestamp()
+  local time = wtk.system.time()
+  local ms = math.floor(time * 1000.0)
+  if ms ~= self.stamp_ms then
+    local second = ms // 1000
+    if second ~= self.stamp_second then self.stamp_second, self.stamp_date = second, os.date(self.format == "json" and "!%Y-%m-%dT%H:%M:%S" or "%Y-%m-%dT%H:%M:%S", second) end
+    self.stamp_ms, self.stamp = ms, string.format(self.format == "json" and "%s.%03dZ" or "%s.%03d", self.stamp_date, ms % 1000)
+  end
+  return self.stamp
+end
+-- Messages can also be tables of fields, for structured logging.
+function Server.Log:line(type, message, ...)
+  if self.format == "json" then
+    local fields = { '{"time":', json_string(self:timestamp()), ',"level":', json_string(type) }
+    if _G.type(message) == "table" then
+      for key, value in pairs(message) do
+        table.insert(fields, "," .. json_string(key) .. ":" .. ((math.type(value) or _G.type(value) == "boolean") and tostring(value) or json_string(value)))
+      end
+    else
+      table.insert(fields, ',"message":' .. json_string(select("#", ...) > 0 and string.format(message, ...) or message))
+    end
+    table.insert(fields, "}\n")
+    return table.concat(fields)
+  end
+  if _G.type(message) == "table" then
+    local fields = {}
+    for key, value in pairs(message) do table.insert(fields, key .. "=" .. tostring(value)) end
+    message = table.concat(fields, " ")
+  elseif select("#", ...) > 0 then
+    message = string.format(message, ...)
+  end
+  return string.format("[%5s][%s]: %s\n", type, self:timestamp(), message)
+end
+function Server.Log:log(type, message, ...)
+  local line = self:line(type, message, ...)
+  if not self.loop then return self.stream:write(line) end
+  if self.bytes + #line > self.max_bytes then
+    if self.policy == "drop" then self.dropped = self.dropped + 1 return end
+    self:flush(true)
+  end
+  table.insert(self.buffer, line)
+  self.bytes = self.bytes + #line
+  if not self.scheduled and not self.waiting then
+    self.scheduled = true
+    self.loop:add(function() self.scheduled = false self:flush() end)
+  end
+end
+-- Writes out as much of the buffer as the stream will take; if it won't take it all, waits for it to become writable.
+function Server.Log:flush(blocking)
+  if self.dropped > 0 then
+    local dropped = self.dropped
+    self.dropped = 0
+    local line = self:line("WARN", "Dropped %d log lines.", dropped)
+    table.insert(self.buffer, line)
+    self.bytes = self.bytes + #line
+  end
+  while #self.buffer > 0 do
+    local written = self.stream:__writev(self.buffer, blocking)
+    -- if the sink has gone away, there's nowhere for these to go
+    if not written then self.buffer, self.bytes = { offset = 0 }, 0 break end
+    if written == 0 then break end
+    self.bytes = self.bytes - written
+  end
+  if #self.buffer > 0 and not blocking and self.loop then
+    if not self.waiting then
+      self.waiting = true
+      self.loop:add(self.stream[1], function() self:flush() end, "write")
+    end
+  elseif self.waiting then
+    self.waiting = false
+    self.loop:rm(self.stream[1])
+  end
+  return self
+end
+function Server.Log:attach(loop) self.loop = loop return self end
+function Server.Log:detach() self:flush(true) self.loop = nil return self end
 function Server.Log:verbose(message, ...) if self._verbose then self:log("VERB", message, ...) end end
 function Server.Log:info(message, ...) self:log("INFO", message, ...) end
 function Server.Log:error(message, ...) self:log("ERROR", message, ...) end
 function Server.Log:warn(message, ...) self:log("WARN", message, ...) end
 
+-- Reloads `file`, and with it every Lua module, whenever a file matching `pattern` (by default, any `.lua` file) changes
+-- in its directory, or with `recursive`, anywhere beneath it. A packed binary reloads from disk straight away.
 function Server:hot_reload(loop, file, options)
-  if not system.mtime(file) then return self.log:warn("Can't find " .. file .. ", so cannot hot reload.") end
-  local old_modified = not package.preload.init and system.mtime(file) or 0
-  loop:add(wtk.countdown.new(0, 0.25), function()
-    if old_modified < system.mtime(file) then
-      local status, err = pcall(function()
-        for k,v in pairs(package.loaded) do if not k:find("%.c$") and not k:find("%.c%.") then package.loaded[k] = nil end end
-        assert(load(wtk.file.open(file, "rb"):read("*all"), "=" .. file))()
-        self.log:info("Hot reloaded " ..  file .. ".")
-        collectgarbage()
-      end)
-      if not status then self.log:error("Attempt to reload routes failed: " .. err) end
-      old_modified = system.mtime(file)
+  if not system.stat(file) then return self.log:warn("Can't find " .. file .. ", so cannot hot reload.") end
+  local pattern = options and options.pattern or "%.lua$"
+  local function reload(paths)
+    local status, err = pcall(function()
+      for k,v in pairs(package.loaded) do if not k:find("%.c$") and not k:find("%.c%.") then package.loaded[k] = nil end end
+      assert(loadfile(file))()
+      self.log:info("Hot reloaded %s%s.", file, paths and (" after changes to " .. table.concat(paths, ", ")) or "")
+      collectgarbage()
+    end)
+    if not status then self.log:error("Attempt to reload routes failed: " .. err) end
+  end
+  local watch, err = loop:watch(file:match("^(.*)/[^/]*$") or ".", function(paths)
+    for i = #paths, 1, -1 do if not paths[i]:find(pattern) then table.remove(paths, i) end end
+    if #paths > 0 then reload(paths) end
+  end, options)
+  if not watch then return self.log:warn("Can't watch %s, so cannot hot reload: %s", file, err) end
+  if package.preload.init then reload() end
+  return watch
+end
+-- With `stat_cache`, file metadata is kept until something changes in the file's directory, rather than looked up on
+-- every request. Misses are kept too. The cache is emptied once it holds `stat_cache` entries (4096, if it's just `true`).
+function Server:stat(path)
+  local cache = self.stat_cache
+  if not cache or not self.loop then return system.stat(path) end
+  local stat = cache.stats[path]
+  if stat ~= nil then return stat or nil end
+  stat = system.stat(path)
+  local dir = path:match("^(.*)/[^/]*$") or "."
+  if not cache.dirs[dir] then
+    if cache.watch then
+      cache.dirs[dir] = cache.watch:add(dir) and true
+    else
+      cache.watch = self.loop:watch(dir, function() cache.stats, cache.count = {}, 0 end, { delay = 0 })
+      cache.dirs[dir] = cache.watch and true
     end
+  end
+  if cache.dirs[dir] then
+    if cache.count >= cache.size then cache.stats, cache.count = {}, 0 end
+    cache.stats[path], cache.count = stat or false, cache.count + 1
+  end
+  return stat
+end
+
+-- Adds an admin route that profiles the whole process for `?seconds=` (default 10), and responds with folded stacks, for flamegraph.pl.
+-- With `?allocations=<bytes>`, samples allocations every so many bytes instead, and responds with bytes allocated per stack.
+-- Only one profile can run at a time. Don't expose this publicly.
+function Server:profiler(path)
+  assert(has_profiler, "profiling requires wtk.profiler.c")
+  self:get(path, function(request)
+    if profiler.stats().running then error({ code = 409, message = "Profiler already running." }) end
+    local interval = tonumber(request.params.allocations)
+    local cpu, allocations = profiler.profile(tonumber(request.params.seconds) or 10, interval and 0 or tonumber(request.params.hz), interval)
+    request:respond(200, { ["content-type"] = "text/plain" }, interval and allocations or cpu)
   end)
+  return self
 end
 
 -- loop:add(0, function() server:console() end)
@@ -17,6 +17,8 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/uio.h>
 
 typedef struct { int fd; } generic_fd_t;
 
@@ -66,6 +68,72 @@ static int f_stream_write(lua_State* L) {
 		return 1;
 }
 
+// Writes out as much of an array of strings as possible in a single writev, skipping the first `offset` bytes of the first
+// string. Written strings are removed from the front of the array, and `offset` is updated to reflect any partial write.
+#define STREAM_MAX_IOV 64
+static int f_stream_writev(lua_State* L) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_rawgeti(L, 1, 1);
+		if (lua_isnil(L, -1)) {
+			lua_pushnil(L);
+			lua_pushstring(L, "stream not open for writing");
+			return 2;
+		}
+		int fd = luaL_checkinteger(L, -1);
+		int blocking = lua_toboolean(L, 3);
+		lua_getfield(L, 2, "offset");
+		size_t offset = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 2);
+		int length = lua_rawlen(L, 2), count = 0;
+		struct iovec iov[STREAM_MAX_IOV];
+		for (int i = 1; i <= length && count < STREAM_MAX_IOV; ++i, ++count) {
+			size_t chunk_length;
+			lua_rawgeti(L, 2, i);
+			const char* chunk = luaL_checklstring(L, -1, &chunk_length);
+			lua_pop(L, 1);
+			size_t skip = i == 1 ? (offset < chunk_length ? offset : chunk_length) : 0;
+			iov[count].iov_base = (char*)&chunk[skip];
+			iov[count].iov_len = chunk_length - skip;
+		}
+		if (count == 0) {
+			lua_pushinteger(L, 0);
+			return 1;
+		}
+		if (blocking)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+		ssize_t written = writev(fd, iov, count);
+		int error = errno;
+		if (blocking)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		if (written == -1 && (error == EAGAIN || error == EWOULDBLOCK))
+			written = 0;
+		if (written < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "error writing to stream: %s", strerror(error));
+			return 2;
+		}
+		size_t remaining = written;
+		int sent = 0;
+		while (sent < count && remaining >= iov[sent].iov_len)
+			remaining -= iov[sent++].iov_len;
+		if (sent > 0) {
+			for (int i = sent + 1; i <= length; ++i) {
+				lua_rawgeti(L, 2, i);
+				lua_rawseti(L, 2, i - sent);
+			}
+			for (int i = length - sent + 1; i <= length; ++i) {
+				lua_pushnil(L);
+				lua_rawseti(L, 2, i);
+			}
+			offset = 0;
+		}
+		lua_pushinteger(L, offset + remaining);
+		lua_setfield(L, 2, "offset");
+		lua_pushinteger(L, written);
+		return 1;
+}
+
 static int f_stream_read(lua_State* L) {
 		luaL_checktype(L, 1, LUA_TTABLE);
 		int bytes = luaL_checkinteger(L, 2);
@@ -144,17 +212,81 @@ static const luaL_Reg stream_lib[] = {
 		{ "__gc",      f_stream_close },
 		{ "__read",    f_stream_read  },
 		{ "__write",   f_stream_write },
+		{ "__writev",  f_stream_writev },
 		{ "seek",      f_stream_seek  },
 		{ "close",     f_stream_close },
 		{ NULL,        NULL           }
 };
 
 
+// If the job this coroutine is running was cancelled with wtk.Loop:cancel, pushes what it was cancelled with. For C
+// functions that yield to the loop, to check when they're resumed.
+int luaW_iscancelled(lua_State* L) {
+	if (lua_getfield(L, LUA_REGISTRYINDEX, "wtk.cancelled") == LUA_TTABLE) {
+		lua_pushthread(L);
+		if (lua_rawget(L, -2) != LUA_TNIL) {
+			lua_remove(L, -2);
+			return 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
 #ifndef _WIN32
 
 	#include <sys/un.h>
 	#include <sys/epoll.h>
 	#include <sys/timerfd.h>
+	#include <sys/signalfd.h>
+	#include <sys/inotify.h>
+	#include <sys/syscall.h>
+	#include <linux/stat.h>
+	#include <sys/eventfd.h>
+	#include <pthread.h>
+
+	// Time spent running callbacks, and how long the loop took to get back to epoll; any callback that takes longer than
+	// `threshold` is reported, along with the stack it was on when it crossed the threshold, if it was running Lua.
+	// If `gc_budget` is set, up to that long is spent collecting garbage each time the loop would otherwise block.
+	typedef struct {
+		lua_Integer iterations, callbacks, deferred, slow;
+		double busy, max_callback, lag, max_lag, threshold, started;
+		int traced;
+		lua_Integer gc_steps, gc_cycles, gc_idle_cycles;
+		double gc_time, max_gc, gc_budget;
+		int gc_growth, gc_kb, gc_pending, gc_generational, gc_sentinel;
+		int stopped;
+	} loop_stats_t;
+	static loop_stats_t* loop_current_stats;
+
+	static double loop_now() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	}
+
+	// whatever hook was set before `loop:instrument`, which is chained to, and put back when it's turned off.
+	static int loop_instrumented;
+	static lua_Hook loop_previous_hook;
+	static int loop_previous_mask, loop_previous_count;
+
+	static void loop_slow_hook(lua_State* L, lua_Debug* ar) {
+		if (loop_previous_hook)
+			loop_previous_hook(L, ar);
+		if (!loop_instrumented) {
+			// left over on a coroutine from before instrumentation was turned off, or chained to from a later hook.
+			if (lua_gethook(L) == loop_slow_hook)
+				lua_sethook(L, loop_previous_hook, loop_previous_mask, loop_previous_count);
+			return;
+		}
+		loop_stats_t* stats = loop_current_stats;
+		if (!stats || stats->traced || stats->started == 0 || loop_now() - stats->started < stats->threshold)
+			return;
+		stats->traced = 1;
+		luaL_traceback(L, L, NULL, 0);
+		lua_setfield(L, LUA_REGISTRYINDEX, "wtk.c.loop.traceback");
+	}
 
 	static int f_loop_new(lua_State* L) {
 		lua_newtable(L);
@@ -162,6 +294,8 @@ static const luaL_Reg stream_lib[] = {
 		lua_pushinteger(L, epollfd); lua_setfield(L, -2, "epollfd");
 		lua_newtable(L); lua_setfield(L, -2, "fds");
 		lua_newtable(L); lua_setfield(L, -2, "deferred");
+		lua_newtable(L); lua_setfield(L, -2, "coroutines");
+		memset(lua_newuserdatauv(L, sizeof(loop_stats_t), 0), 0, sizeof(loop_stats_t)); lua_setfield(L, -2, "__stats");
 		luaL_setmetatable(L, "wtk.c.loop");
 		return 1;
 	}
@@ -209,6 +343,9 @@ static const luaL_Reg stream_lib[] = {
 		lua_rawseti(L, -2, 1);
 		lua_pushvalue(L, 2);
 		lua_rawseti(L, -2, 2);
+		// whatever this callback is working on behalf of; usually a job. Reported if the callback is slow.
+		lua_pushvalue(L, 6);
+		lua_rawseti(L, -2, 3);
 		int table = lua_gettop(L);
 
 		for (int i = 0; i < length; ++i) {
@@ -244,44 +381,366 @@ static const luaL_Reg stream_lib[] = {
 		return 1;
 	}
 
+	static void loop_start_callback(lua_State* L, loop_stats_t* stats) {
+		if (stats->threshold > 0) {
+			lua_pushnil(L);
+			lua_setfield(L, 1, "stepped");
+		}
+		stats->started = loop_now();
+	}
+
+	// Called after every callback with the table it was registered with, if any.
+	static void loop_finish_callback(lua_State* L, loop_stats_t* stats, int fd, int entry) {
+		double duration = loop_now() - stats->started;
+		stats->started = 0;
+		stats->busy += duration;
+		if (duration > stats->max_callback)
+			stats->max_callback = duration;
+		if (stats->threshold > 0 && duration >= stats->threshold) {
+			stats->slow++;
+			lua_getfield(L, 1, "slow_handler");
+			if (lua_isfunction(L, -1)) {
+				lua_pushnumber(L, duration);
+				if (fd >= 0) lua_pushinteger(L, fd); else lua_pushnil(L);
+				lua_getfield(L, LUA_REGISTRYINDEX, "wtk.c.loop.traceback");
+				// the job the callback was registered for, or failing that, the last one it stepped.
+				if (entry) lua_rawgeti(L, entry, 3); else lua_pushnil(L);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					lua_getfield(L, 1, "stepped");
+				}
+				// a diagnostics hook shouldn't be able to take the loop down with it.
+				if (lua_pcall(L, 4, 0, 0)) {
+					fprintf(stderr, "error in slow callback handler: %s\n", lua_tostring(L, -1));
+					lua_pop(L, 1);
+				}
+			} else
+				lua_pop(L, 1);
+		}
+		if (stats->traced) {
+			stats->traced = 0;
+			lua_pushnil(L);
+			lua_setfield(L, LUA_REGISTRYINDEX, "wtk.c.loop.traceback");
+		}
+	}
+
+	// Runs collector steps for up to `gc_budget` seconds. An idle cycle starts once the heap has grown by `gc_growth`
+	// percent since the last one finished; in generational mode, each idle period gets a single minor collection. Returns whether
+	// the cycle is still unfinished.
+	static int loop_gc_idle(lua_State* L, loop_stats_t* stats) {
+		if (!stats->gc_pending && lua_gc(L, LUA_GCCOUNT) < stats->gc_kb + stats->gc_kb * stats->gc_growth / 100)
+			return 0;
+		double started = loop_now(), elapsed;
+		int finished;
+		do {
+			finished = lua_gc(L, LUA_GCSTEP, 0) || stats->gc_generational;
+			stats->gc_steps++;
+			elapsed = loop_now() - started;
+		} while (!finished && elapsed < stats->gc_budget);
+		stats->gc_time += elapsed;
+		if (elapsed > stats->max_gc)
+			stats->max_gc = elapsed;
+		stats->gc_pending = !finished;
+		if (finished) {
+			stats->gc_idle_cycles++;
+			stats->gc_kb = lua_gc(L, LUA_GCCOUNT);
+		}
+		return stats->gc_pending;
+	}
+
+	// Counts every collection, idle or not, by resurrecting itself each time it's finalized.
+	static void loop_gc_sentinel(lua_State* L, int stats) {
+		lua_newuserdatauv(L, 0, 1);
+		lua_pushvalue(L, stats);
+		lua_setiuservalue(L, -2, 1);
+		luaL_setmetatable(L, "wtk.c.loop.sentinel");
+		lua_pop(L, 1);
+	}
+
+	static int f_loop_sentinel_gc(lua_State* L) {
+		lua_getiuservalue(L, 1, 1);
+		((loop_stats_t*)lua_touserdata(L, -1))->gc_cycles++;
+		loop_gc_sentinel(L, lua_gettop(L));
+		return 0;
+	}
+
 	static int f_loop_run(lua_State* L) {
 		lua_getfield(L, 1, "epollfd");
 		int epollfd = luaL_checkinteger(L, -1);
+		lua_getfield(L, 1, "__stats");
+		loop_stats_t* stats = lua_touserdata(L, -1);
+		loop_current_stats = stats;
 		struct epoll_event ev = {0}, events[100] = {0};
 		luaL_getsubtable(L, 1, "fds");
-		while (1) {
+		stats->stopped = 0;
+		while (!stats->stopped) {
+			double iteration = loop_now();
+			// anything deferred while running these goes into the other queue, and is run next time around.
 			luaL_getsubtable(L, 1, "deferred");
-			lua_newtable(L);
-			lua_setfield(L, 1, "deferred");
 			size_t len = lua_rawlen(L, -1);
 			if (len) {
+				luaL_getsubtable(L, 1, "__deferred");
+				lua_setfield(L, 1, "deferred");
 				for (int i = 1; i <= len; ++i) {
 					lua_rawgeti(L, -1, i);
+					lua_pushnil(L);
+					lua_rawseti(L, -3, i);
+					loop_start_callback(L, stats);
 					lua_call(L, 0, 0);
+					stats->deferred++;
+					loop_finish_callback(L, stats, -1, 0);
 				}
+				lua_pushvalue(L, -1);
+				lua_setfield(L, 1, "__deferred");
+				lua_getfield(L, 1, "deferred");
+				len = lua_rawlen(L, -1);
+				lua_pop(L, 1);
 			}
 			lua_pop(L, 1);
-			int nfds = epoll_wait(epollfd, events, 100, len > 0 ? 0 : -1);
+			if (stats->stopped)
+				break;
+			double lag = loop_now() - iteration;
+			stats->lag = lag;
+			if (lag > stats->max_lag)
+				stats->max_lag = lag;
+			stats->iterations++;
+			int nfds = epoll_wait(epollfd, events, 100, len > 0 || stats->gc_budget > 0 ? 0 : -1);
+			if (nfds == 0 && len == 0 && stats->gc_budget > 0) {
+				// nothing to do; collect until something comes in, or there's no more garbage worth collecting.
+				while (loop_gc_idle(L, stats) && (nfds = epoll_wait(epollfd, events, 100, 0)) == 0);
+				if (nfds == 0)
+					nfds = epoll_wait(epollfd, events, 100, -1);
+			}
+			iteration = loop_now();
 			for (int n = 0; n < nfds; ++n) {
 				lua_pushinteger(L, events[n].data.fd);
 				lua_rawget(L, -2);
 				if (!lua_isnil(L, -1)) { // in the case where we've removed the callback, and there are lingering events.
 					lua_rawgeti(L, -1, 1);
+					loop_start_callback(L, stats);
 					if (lua_pcall(L, 0, 1, 0))
 						return luaL_error(L, "error running callback: %s", lua_tostring(L, -1));
+					stats->callbacks++;
+					loop_finish_callback(L, stats, events[n].data.fd, lua_gettop(L) - 1);
 					lua_pop(L, 2);
 				} else {
 					// epoll_ctl(epollfd, EPOLL_CTL_DEL, events[n].data.fd, NULL);
 					lua_pop(L, 1);
 				}
 			}
+			// the time the loop spends away from epoll is how late any newly ready event will be handled.
+			if (nfds > 0) {
+				lag = loop_now() - iteration;
+				if (lag > stats->max_lag)
+					stats->max_lag = lag;
+			}
+		}
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+
+	// Makes `run` return once the callback that called this has finished; anything else ready to go waits for the next `run`.
+	static int f_loop_stop(lua_State* L) {
+		lua_getfield(L, 1, "__stats");
+		((loop_stats_t*)lua_touserdata(L, -1))->stopped = 1;
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+
+	static const struct { const char* name; int signo; } loop_signals[] = {
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+		{ "TERM", SIGTERM }, { "CHLD", SIGCHLD }, { "ALRM", SIGALRM }, { "PIPE", SIGPIPE }, { "WINCH", SIGWINCH },
+		{ NULL, 0 }
+	};
+
+	static int loop_checksignal(lua_State* L, int index) {
+		if (lua_type(L, index) == LUA_TNUMBER)
+			return lua_tointeger(L, index);
+		const char* name = luaL_checkstring(L, index);
+		if (strncmp(name, "SIG", 3) == 0)
+			name += 3;
+		for (int i = 0; loop_signals[i].name; ++i) {
+			if (strcmp(loop_signals[i].name, name) == 0)
+				return loop_signals[i].signo;
+		}
+		return luaL_error(L, "unknown signal '%s'", name);
+	}
+
+	// Reads everything waiting on the loop's signalfd, calling the handler for each signal with its name (or number, if it
+	// has none) and the pid that sent it.
+	static int f_loop_signal_read(lua_State* L) {
+		struct signalfd_siginfo info;
+		lua_getfield(L, lua_upvalueindex(1), "signalfd");
+		int fd = lua_tointeger(L, -1);
+		luaL_getsubtable(L, lua_upvalueindex(1), "signals");
+		while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+			lua_rawgeti(L, -1, info.ssi_signo);
+			if (lua_isfunction(L, -1)) {
+				int i;
+				for (i = 0; loop_signals[i].name && (uint32_t)loop_signals[i].signo != info.ssi_signo; ++i);
+				if (loop_signals[i].name) lua_pushstring(L, loop_signals[i].name); else lua_pushinteger(L, info.ssi_signo);
+				lua_pushinteger(L, info.ssi_pid);
+				lua_call(L, 2, 0);
+			} else
+				lua_pop(L, 1);
+		}
+		return 0;
+	}
+
+	// Calls `handler` from the loop whenever the signal arrives, rather than from a signal handler. The signal is blocked,
+	// and read from a signalfd the loop watches; a nil `handler` unblocks it again. Only the calling thread's mask
+	// changes, so this should be done before any threads are started.
+	static int f_loop_signal(lua_State* L) {
+		int signo = loop_checksignal(L, 2);
+		if (!lua_isnil(L, 3))
+			luaL_checktype(L, 3, LUA_TFUNCTION);
+		luaL_getsubtable(L, 1, "signals");
+		lua_pushvalue(L, 3);
+		lua_rawseti(L, -2, signo);
+		sigset_t mask, change;
+		sigemptyset(&mask);
+		sigemptyset(&change);
+		sigaddset(&change, signo);
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			sigaddset(&mask, lua_tointeger(L, -2));
+			lua_pop(L, 1);
+		}
+		sigprocmask(lua_isnil(L, 3) ? SIG_UNBLOCK : SIG_BLOCK, &change, NULL);
+		lua_getfield(L, 1, "signalfd");
+		if (lua_isnil(L, -1)) {
+			int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+			if (fd == -1)
+				return luaL_error(L, "can't create signalfd: %s", strerror(errno));
+			lua_pushinteger(L, fd);
+			lua_setfield(L, 1, "signalfd");
+			lua_getfield(L, 1, "add");
+			lua_pushvalue(L, 1);
+			lua_pushinteger(L, fd);
+			lua_pushvalue(L, 1);
+			lua_pushcclosure(L, f_loop_signal_read, 1);
+			lua_call(L, 3, 0);
+		} else if (signalfd(lua_tointeger(L, -1), &mask, 0) == -1)
+			return luaL_error(L, "can't update signalfd: %s", strerror(errno));
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+
+	// Returns counts and timings since the loop was created, or since the last call with `reset` set.
+	static int f_loop_stats(lua_State* L) {
+		lua_getfield(L, 1, "__stats");
+		loop_stats_t* stats = lua_touserdata(L, -1);
+		lua_newtable(L);
+		lua_pushinteger(L, stats->iterations); lua_setfield(L, -2, "iterations");
+		lua_pushinteger(L, stats->callbacks); lua_setfield(L, -2, "callbacks");
+		lua_pushinteger(L, stats->deferred); lua_setfield(L, -2, "deferred");
+		lua_pushinteger(L, stats->slow); lua_setfield(L, -2, "slow");
+		lua_pushnumber(L, stats->busy); lua_setfield(L, -2, "busy");
+		lua_pushnumber(L, stats->max_callback); lua_setfield(L, -2, "max_callback");
+		lua_pushnumber(L, stats->lag); lua_setfield(L, -2, "lag");
+		lua_pushnumber(L, stats->max_lag); lua_setfield(L, -2, "max_lag");
+		lua_pushinteger(L, stats->gc_steps); lua_setfield(L, -2, "gc_steps");
+		lua_pushinteger(L, stats->gc_cycles); lua_setfield(L, -2, "gc_cycles");
+		lua_pushinteger(L, stats->gc_idle_cycles); lua_setfield(L, -2, "gc_idle_cycles");
+		lua_pushnumber(L, stats->gc_time); lua_setfield(L, -2, "gc_time");
+		lua_pushnumber(L, stats->max_gc); lua_setfield(L, -2, "max_gc");
+		if (lua_toboolean(L, 2)) {
+			stats->iterations = stats->callbacks = stats->deferred = stats->slow = 0;
+			stats->gc_steps = stats->gc_cycles = stats->gc_idle_cycles = 0;
+			stats->busy = stats->max_callback = stats->max_lag = stats->gc_time = stats->max_gc = 0;
+		}
+		return 1;
+	}
+
+	// Reports callbacks that take longer than `threshold` seconds to `handler(duration, fd, traceback, job)`; errors it raises
+	// are printed to stderr, rather than stopping the loop. To get a
+	// traceback from inside the slow code, this sets a count hook on the main thread; coroutines created afterwards inherit it.
+	// Any hook that was already set is called from it, and put back once `threshold` is 0 again.
+	static int f_loop_instrument(lua_State* L) {
+		double threshold = luaL_optnumber(L, 2, 0);
+		lua_getfield(L, 1, "__stats");
+		loop_stats_t* stats = lua_touserdata(L, -1);
+		stats->threshold = threshold;
+		lua_pushvalue(L, 3);
+		lua_setfield(L, 1, "slow_handler");
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+		lua_State* main = lua_tothread(L, -1);
+		if (threshold > 0 && !loop_instrumented) {
+			loop_instrumented = 1;
+			loop_previous_hook = lua_gethook(main);
+			loop_previous_mask = lua_gethookmask(main);
+			loop_previous_count = lua_gethookcount(main);
+			lua_sethook(main, loop_slow_hook, LUA_MASKCOUNT | loop_previous_mask, loop_previous_hook ? loop_previous_count : 1000);
+			if (main != L)
+				lua_sethook(L, loop_slow_hook, LUA_MASKCOUNT | loop_previous_mask, loop_previous_hook ? loop_previous_count : 1000);
+		} else if (threshold <= 0 && loop_instrumented) {
+			loop_instrumented = 0;
+			// if something's hooked in on top of us since, it's left alone; it'll still chain through, to no effect.
+			if (lua_gethook(main) == loop_slow_hook)
+				lua_sethook(main, loop_previous_hook, loop_previous_mask, loop_previous_count);
+			if (main != L && lua_gethook(L) == loop_slow_hook)
+				lua_sethook(L, loop_previous_hook, loop_previous_mask, loop_previous_count);
 		}
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+
+	// Moves garbage collection into the time the loop spends waiting. `options` are `budget`, the most time to spend
+	// collecting before checking for events again (default 1ms), `growth`, the percentage the heap must grow by before
+	// another idle cycle (default 50; the automatic collector waits for 100), and `mode`, "incremental" or "generational",
+	// along with that mode's parameters (`pause`, `stepmul` and `stepsize`, or `minormul` and `majormul`). `false` turns
+	// idle collection off again. There's no asking Lua for the mode without switching it, which costs a full collection
+	// when going back to generational, so the loop goes by the last mode set here, and assumes incremental, Lua's default,
+	// until one is; a mode set any other way, like with `collectgarbage`, should be passed here as well.
+	static int f_loop_collect(lua_State* L) {
+		lua_getfield(L, 1, "__stats");
+		loop_stats_t* stats = lua_touserdata(L, -1);
+		int index = lua_gettop(L);
+		if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+			stats->gc_budget = 0;
+			lua_pushvalue(L, 1);
+			return 1;
+		}
+		if (!lua_isnoneornil(L, 2))
+			luaL_checktype(L, 2, LUA_TTABLE);
+		else {
+			lua_newtable(L);
+			lua_replace(L, 2);
+		}
+		lua_getfield(L, 2, "budget");
+		stats->gc_budget = luaL_optnumber(L, -1, 0.001);
+		lua_getfield(L, 2, "growth");
+		stats->gc_growth = luaL_optinteger(L, -1, 50);
+		lua_getfield(L, 2, "mode");
+		const char* mode = luaL_optstring(L, -1, NULL);
+		if (mode && strcmp(mode, "generational") == 0) {
+			lua_getfield(L, 2, "minormul");
+			lua_getfield(L, 2, "majormul");
+			lua_gc(L, LUA_GCGEN, (int)luaL_optinteger(L, -2, 0), (int)luaL_optinteger(L, -1, 0));
+			stats->gc_generational = 1;
+		} else if (mode && strcmp(mode, "incremental") == 0) {
+			lua_getfield(L, 2, "pause");
+			lua_getfield(L, 2, "stepmul");
+			lua_getfield(L, 2, "stepsize");
+			lua_gc(L, LUA_GCINC, (int)luaL_optinteger(L, -3, 0), (int)luaL_optinteger(L, -2, 0), (int)luaL_optinteger(L, -1, 0));
+			stats->gc_generational = 0;
+		} else if (mode)
+			return luaL_error(L, "unknown gc mode '%s'", mode);
+		stats->gc_pending = 0;
+		if (!stats->gc_sentinel) {
+			stats->gc_sentinel = 1;
+			loop_gc_sentinel(L, index);
+		}
+		lua_pushvalue(L, 1);
 		return 1;
 	}
 
 	static int f_loop_gc(lua_State* L) {
 		lua_getfield(L, 1, "epollfd");
 		close(luaL_checkinteger(L, -1));
+		lua_getfield(L, 1, "signalfd");
+		if (lua_isinteger(L, -1))
+			close(lua_tointeger(L, -1));
 		return 1;
 	}
 
@@ -290,6 +749,11 @@ static const luaL_Reg stream_lib[] = {
 		{ "add",      f_loop_add   },
 		{ "rm",       f_loop_rm    },
 		{ "run",      f_loop_run   },
+		{ "stop",     f_loop_stop  },
+		{ "signal",   f_loop_signal },
+		{ "stats",    f_loop_stats },
+		{ "instrument", f_loop_instrument },
+		{ "gc",       f_loop_collect },
 		{ "__gc",     f_loop_gc    },
 		{ NULL,       NULL }
 	};
@@ -311,6 +775,153 @@ static const luaL_Reg stream_lib[] = {
 		return f_stream_new(L, fd, -1);
 	}
 
+	#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+	// Watches `path`, and if `recursive`, every directory beneath it. Each watch descriptor maps to its path in `paths`.
+	static int watch_add(lua_State* L, int watch, const char* path, int recursive) {
+		lua_rawgeti(L, watch, 0);
+		int wd = inotify_add_watch(lua_tointeger(L, -1), path, WATCH_MASK);
+		lua_pop(L, 1);
+		if (wd == -1)
+			return -1;
+		luaL_checkstack(L, 4, "watching too deep a tree");
+		luaL_getsubtable(L, watch, "paths");
+		lua_pushstring(L, path);
+		lua_rawseti(L, -2, wd);
+		lua_pop(L, 1);
+		DIR* dir = recursive ? opendir(path) : NULL;
+		if (dir) {
+			struct dirent* entry;
+			struct stat file;
+			while ((entry = readdir(dir)) != NULL) {
+				if (strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".") == 0 || (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN))
+					continue;
+				const char* child = lua_pushfstring(L, "%s/%s", path, entry->d_name);
+				if (entry->d_type == DT_DIR || (stat(child, &file) == 0 && S_ISDIR(file.st_mode)))
+					watch_add(L, watch, child, recursive);
+				lua_pop(L, 1);
+			}
+			closedir(dir);
+		}
+		return wd;
+	}
+
+	// Adds the path on top of the stack to `list`, unless it's already in `seen`.
+	static void watch_report(lua_State* L, int list, int seen) {
+		lua_pushvalue(L, -1);
+		if (lua_rawget(L, seen) == LUA_TNIL) {
+			lua_pushvalue(L, -2);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, seen);
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, list, lua_rawlen(L, list) + 1);
+		}
+		lua_pop(L, 1);
+	}
+
+	// A stream on an inotify instance, watching `path`, and with `recursive` set in `options`, the tree beneath it.
+	static int f_watch_new(lua_State* L) {
+		const char* path = luaL_checkstring(L, 1);
+		int recursive = 0;
+		if (lua_type(L, 2) == LUA_TTABLE) {
+			lua_getfield(L, 2, "recursive");
+			recursive = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+		}
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd == -1) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't create watch: %s", strerror(errno));
+			return 2;
+		}
+		f_stream_new(L, fd, -1);
+		luaL_setmetatable(L, "wtk.c.watch");
+		lua_pushboolean(L, recursive);
+		lua_setfield(L, -2, "recursive");
+		if (watch_add(L, lua_gettop(L), path, recursive) == -1) {
+			int error = errno;
+			close(fd);
+			lua_pushnil(L);
+			lua_rawseti(L, -2, 0);
+			errno = error;
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't watch %s: %s", path, strerror(errno));
+			return 2;
+		}
+		return 1;
+	}
+
+	static int f_watch_add(lua_State* L) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		const char* path = luaL_checkstring(L, 2);
+		lua_getfield(L, 1, "recursive");
+		int wd = watch_add(L, 1, path, lua_toboolean(L, -1));
+		if (wd == -1) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't watch %s: %s", path, strerror(errno));
+			return 2;
+		}
+		lua_pushinteger(L, wd);
+		return 1;
+	}
+
+	// Reads everything waiting, and returns a list of the paths that changed, each once. Directories created under a
+	// recursive watch are watched in turn. If the kernel's queue overflowed, every watched path is reported.
+	static int f_watch_changes(lua_State* L) {
+		char buffer[16*1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_rawgeti(L, 1, 0);
+		int fd = luaL_checkinteger(L, -1);
+		lua_getfield(L, 1, "recursive");
+		int recursive = lua_toboolean(L, -1);
+		luaL_getsubtable(L, 1, "paths");
+		int paths = lua_gettop(L);
+		lua_newtable(L);
+		lua_newtable(L);
+		int list = paths + 1, seen = paths + 2;
+		ssize_t length;
+		while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+			const struct inotify_event* event;
+			for (char* ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + event->len) {
+				event = (const struct inotify_event*)ptr;
+				if (event->mask & IN_Q_OVERFLOW) {
+					lua_pushnil(L);
+					while (lua_next(L, paths)) {
+						watch_report(L, list, seen);
+						lua_pop(L, 1);
+					}
+					continue;
+				}
+				if (lua_rawgeti(L, paths, event->wd) == LUA_TNIL) {
+					lua_pop(L, 1);
+					continue;
+				}
+				if (event->mask & IN_IGNORED) {
+					lua_pushnil(L);
+					lua_rawseti(L, paths, event->wd);
+				}
+				if (event->len > 0) {
+					lua_pushfstring(L, "%s/%s", lua_tostring(L, -1), event->name);
+					lua_remove(L, -2);
+				}
+				if (recursive && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+					watch_add(L, 1, lua_tostring(L, -1), 1);
+				watch_report(L, list, seen);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pushvalue(L, list);
+		return 1;
+	}
+
+	static const luaL_Reg watch_lib[] = {
+		{ "add",       f_watch_add     },
+		{ "changes",   f_watch_changes },
+		{ "close",     f_stream_close  },
+		{ "__gc",      f_stream_close  },
+		{ NULL,        NULL            }
+	};
+
 	static int f_pipe_new(lua_State* L) {
 		int fds[2];
 		if (pipe(fds) == -1) {
@@ -324,8 +935,7 @@ static const luaL_Reg stream_lib[] = {
 	}
 	
 
-	static int f_file_new(lua_State* L) {
-		const char* flags = luaL_optstring(L, 2, "rb");
+	static int file_flags(const char* flags) {
 		int flagInt = 0;
 		if (strchr(flags, 'r') && (strchr(flags, 'w') || strchr(flags, 'a')))
 			flagInt = O_RDWR;
@@ -337,15 +947,504 @@ static const luaL_Reg stream_lib[] = {
 			flagInt |= O_TRUNC | O_CREAT;
 		if (strchr(flags, 'a'))
 			flagInt |= O_APPEND;
-		int fd = open(luaL_checkstring(L, 1), flagInt | O_NONBLOCK, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		return flagInt | O_NONBLOCK;
+	}
+
+	// Regular files are marked as such; epoll won't take them, so from a job, they're read and written on the thread pool.
+	static int file_stream(lua_State* L, int fd, const char* flags) {
+		struct stat file;
+		f_stream_new(L, strchr(flags, 'r') ? fd : -1, (strchr(flags, 'r') || strchr(flags, 'w')) ? fd : -1);
+		if (fstat(fd, &file) == 0 && S_ISREG(file.st_mode)) {
+			lua_pushboolean(L, 1);
+			lua_setfield(L, -2, "file");
+		}
+		return 1;
+	}
+
+	static int f_file_new(lua_State* L) {
+		const char* flags = luaL_optstring(L, 2, "rb");
+		int fd = open(luaL_checkstring(L, 1), file_flags(flags), S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 		if (fd == -1) {
 			lua_pushnil(L);
 			lua_pushfstring(L, "unable to open file %s: %s", luaL_checkstring(L, 1), strerror(errno));
 			return 2;
 		}
-		return f_stream_new(L, strchr(flags, 'r') ? fd : -1, (strchr(flags, 'r') || strchr(flags, 'w')) ? fd : -1);
+		return file_stream(L, fd, flags);
 	}
-	
+
+	// A directory being walked; entries are read out of `buffer` a getdents64 batch at a time.
+	typedef struct {
+		int fd, offset, length;
+		char* path;
+		char buffer[];
+	} walk_dir_t;
+
+	struct walk_dirent64 {
+		unsigned long long d_ino;
+		long long d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+
+	// The state of a walk, and the entry it's on. Nothing is allocated per entry; the entry's name points into the
+	// buffer of the directory at the top of the stack, and its statx is only made if one of those fields is asked for.
+	typedef struct {
+		walk_dir_t** dirs;
+		int depth, capacity, buffer_size, recursive, descend, stated;
+		const char* name;
+		unsigned char type;
+		struct statx stx;
+	} walk_t;
+
+	static int walk_push(walk_t* walk, int parent, const char* name, const char* path) {
+		int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+			return -1;
+		if (walk->depth == walk->capacity) {
+			walk->capacity = walk->capacity ? walk->capacity * 2 : 8;
+			walk->dirs = realloc(walk->dirs, sizeof(walk_dir_t*) * walk->capacity);
+		}
+		walk_dir_t* dir = malloc(sizeof(walk_dir_t) + walk->buffer_size);
+		dir->fd = fd;
+		dir->offset = dir->length = 0;
+		dir->path = strdup(path);
+		walk->dirs[walk->depth++] = dir;
+		return 0;
+	}
+
+	static void walk_pop(walk_t* walk) {
+		walk_dir_t* dir = walk->dirs[--walk->depth];
+		close(dir->fd);
+		free(dir->path);
+		free(dir);
+	}
+
+	static int walk_stat(walk_t* walk) {
+		if (!walk->stated) {
+			if (!walk->name || syscall(SYS_statx, walk->dirs[walk->depth - 1]->fd, walk->name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS | STATX_BTIME, &walk->stx) == -1)
+				return -1;
+			walk->stated = 1;
+		}
+		return 0;
+	}
+
+	static const char* walk_type(walk_t* walk) {
+		if (walk->type == DT_UNKNOWN && walk_stat(walk) == 0)
+			walk->type = IFTODT(walk->stx.stx_mode);
+		switch (walk->type) {
+			case DT_REG: return "file";
+			case DT_DIR: return "dir";
+			case DT_LNK: return "link";
+			default: return "other";
+		}
+	}
+
+	// Returns the path and type of the next entry, descending into the last one first if it was a directory, the walk is
+	// recursive, and it wasn't skipped. Symbolic links are never followed.
+	static int f_walk_call(lua_State* L) {
+		walk_t* walk = luaL_checkudata(L, 1, "wtk.c.walk");
+		if (walk->descend && walk->name && walk->type == DT_DIR) {
+			walk_dir_t* dir = walk->dirs[walk->depth - 1];
+			const char* path = lua_pushfstring(L, "%s/%s", dir->path, walk->name);
+			walk_push(walk, dir->fd, walk->name, path);
+			lua_pop(L, 1);
+		}
+		walk->name = NULL;
+		walk->stated = 0;
+		while (walk->depth > 0) {
+			walk_dir_t* dir = walk->dirs[walk->depth - 1];
+			if (dir->offset >= dir->length) {
+				long length = syscall(SYS_getdents64, dir->fd, dir->buffer, walk->buffer_size);
+				if (length <= 0) {
+					walk_pop(walk);
+					continue;
+				}
+				dir->offset = 0;
+				dir->length = length;
+			}
+			struct walk_dirent64* entry = (struct walk_dirent64*)&dir->buffer[dir->offset];
+			dir->offset += entry->d_reclen;
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+				continue;
+			walk->name = entry->d_name;
+			walk->type = entry->d_type;
+			walk->descend = walk->recursive;
+			lua_pushfstring(L, "%s/%s", dir->path, walk->name);
+			lua_pushstring(L, walk_type(walk));
+			lua_pushvalue(L, 1);
+			return 3;
+		}
+		return 0;
+	}
+
+	// Fields of the current entry. `name`, `type` and `depth` are free; the rest come from a single statx, made the first
+	// time one of them is asked for.
+	static int f_walk_index(lua_State* L) {
+		walk_t* walk = luaL_checkudata(L, 1, "wtk.c.walk");
+		const char* key = luaL_checkstring(L, 2);
+		if (luaL_getmetafield(L, 1, key) != LUA_TNIL && lua_iscfunction(L, -1))
+			return 1;
+		if (!walk->name)
+			return 0;
+		if (strcmp(key, "name") == 0) {
+			lua_pushstring(L, walk->name);
+			return 1;
+		} else if (strcmp(key, "type") == 0) {
+			lua_pushstring(L, walk_type(walk));
+			return 1;
+		} else if (strcmp(key, "depth") == 0) {
+			lua_pushinteger(L, walk->depth);
+			return 1;
+		}
+		if (walk_stat(walk)) {
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(errno));
+			return 2;
+		}
+		if (strcmp(key, "size") == 0) lua_pushinteger(L, walk->stx.stx_size);
+		else if (strcmp(key, "inode") == 0) lua_pushinteger(L, walk->stx.stx_ino);
+		else if (strcmp(key, "mode") == 0) lua_pushinteger(L, walk->stx.stx_mode);
+		else if (strcmp(key, "nlink") == 0) lua_pushinteger(L, walk->stx.stx_nlink);
+		else if (strcmp(key, "uid") == 0) lua_pushinteger(L, walk->stx.stx_uid);
+		else if (strcmp(key, "gid") == 0) lua_pushinteger(L, walk->stx.stx_gid);
+		else if (strcmp(key, "blocks") == 0) lua_pushinteger(L, walk->stx.stx_blocks);
+		else if (strcmp(key, "atime") == 0) lua_pushnumber(L, walk->stx.stx_atime.tv_sec + walk->stx.stx_atime.tv_nsec / 1000000000.0);
+		else if (strcmp(key, "mtime") == 0) lua_pushnumber(L, walk->stx.stx_mtime.tv_sec + walk->stx.stx_mtime.tv_nsec / 1000000000.0);
+		else if (strcmp(key, "ctime") == 0) lua_pushnumber(L, walk->stx.stx_ctime.tv_sec + walk->stx.stx_ctime.tv_nsec / 1000000000.0);
+		else if (strcmp(key, "btime") == 0 && (walk->stx.stx_mask & STATX_BTIME)) lua_pushnumber(L, walk->stx.stx_btime.tv_sec + walk->stx.stx_btime.tv_nsec / 1000000000.0);
+		else return 0;
+		return 1;
+	}
+
+	// Don't descend into the current entry.
+	static int f_walk_skip(lua_State* L) {
+		luaL_checkudata(L, 1, "wtk.c.walk");
+		((walk_t*)lua_touserdata(L, 1))->descend = 0;
+		return 0;
+	}
+
+	static int f_walk_close(lua_State* L) {
+		walk_t* walk = luaL_checkudata(L, 1, "wtk.c.walk");
+		while (walk->depth > 0)
+			walk_pop(walk);
+		free(walk->dirs);
+		walk->dirs = NULL;
+		walk->capacity = 0;
+		walk->name = NULL;
+		return 0;
+	}
+
+	static const luaL_Reg walk_lib[] = {
+		{ "__call",    f_walk_call  },
+		{ "__index",   f_walk_index },
+		{ "__gc",      f_walk_close },
+		{ "__close",   f_walk_close },
+		{ "skip",      f_walk_skip  },
+		{ "close",     f_walk_close },
+		{ NULL,        NULL         }
+	};
+
+	// Iterates over the entries of a directory, returning each one's path, type ("file", "dir", "link" or "other") and the
+	// walker, which has the entry's statx fields. Options are `recursive`, and `buffer`, the size of each getdents64 read.
+	static int f_system_walk(lua_State* L) {
+		const char* path = luaL_checkstring(L, 1);
+		walk_t* walk = lua_newuserdatauv(L, sizeof(walk_t), 0);
+		memset(walk, 0, sizeof(walk_t));
+		walk->buffer_size = 32*1024;
+		luaL_setmetatable(L, "wtk.c.walk");
+		if (lua_type(L, 2) == LUA_TTABLE) {
+			lua_getfield(L, 2, "recursive");
+			walk->recursive = lua_toboolean(L, -1);
+			lua_getfield(L, 2, "buffer");
+			walk->buffer_size = luaL_optinteger(L, -1, walk->buffer_size);
+			lua_pop(L, 2);
+		}
+		if (walk_push(walk, AT_FDCWD, path, path)) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "can't walk %s: %s", path, strerror(errno));
+			return 2;
+		}
+		lua_pushnil(L);
+		lua_pushnil(L);
+		lua_pushvalue(L, -3);
+		return 4;
+	}
+
+	static void system_pushstat(lua_State* L, struct stat* file);
+
+	#ifndef LUAW_OFFLOAD_T
+		#define LUAW_OFFLOAD_T
+		// CPU-heavy work that a module can have run on the pool. `run` is handed the input, and mallocs its output; it
+		// returns NULL, or a static error message. Modules export these as light userdata, so wtk.c needn't link them.
+		typedef const char* (*luaW_offload_f)(const char* input, size_t length, int option, char** output, size_t* output_length);
+		typedef struct { const char* name; luaW_offload_f run; } luaW_offload_t;
+	#endif
+
+	// Blocking file operations, run on a small pool of threads. A request holds everything its operation needs, and points
+	// only at strings the Lua side keeps alive until it's completed, so the workers never touch the Lua state. Those stay
+	// anchored even if whatever was waiting on the request is cancelled, and the request works on its own duplicate of any
+	// descriptor, so closing a stream with a request in flight can't have it land on whatever reuses the number. Completed
+	// requests are queued, and the pool's eventfd, which the loop watches, is bumped.
+	typedef enum { POOL_OPEN, POOL_READ, POOL_WRITE, POOL_FSYNC, POOL_STAT, POOL_CALL } pool_op_e;
+	static const char* pool_ops[] = { "open", "read", "write", "fsync", "stat", NULL };
+
+	typedef struct pool_request_t {
+		struct pool_request_t* next;
+		pool_op_e op;
+		int fd, flags, option, error;
+		long long offset;
+		size_t length;
+		ssize_t result;
+		const char* input;
+		char* output;
+		const char* message;
+		const luaW_offload_t* routine;
+		char mode[8];
+		struct stat stat;
+	} pool_request_t;
+
+	static struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		pool_request_t *queued, *last, *completed;
+		int eventfd, threads, idle, max_threads;
+	} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, -1, 0, 0, 4 };
+
+	static void pool_run(pool_request_t* request) {
+		switch (request->op) {
+			case POOL_OPEN: request->result = open(request->input, request->flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); break;
+			case POOL_READ:
+				if (!(request->output = malloc(request->length ? request->length : 1))) {
+					request->result = -1;
+					errno = ENOMEM;
+					break;
+				}
+				request->result = request->offset >= 0 ? pread(request->fd, request->output, request->length, request->offset) : read(request->fd, request->output, request->length);
+			break;
+			case POOL_WRITE: request->result = request->offset >= 0 ? pwrite(request->fd, request->input, request->length, request->offset) : write(request->fd, request->input, request->length); break;
+			case POOL_FSYNC: request->result = fsync(request->fd); break;
+			case POOL_STAT: request->result = stat(request->input, &request->stat); break;
+			case POOL_CALL: {
+				size_t length = 0;
+				request->message = request->routine->run(request->input, request->length, request->option, &request->output, &length);
+				request->result = request->message ? -1 : (ssize_t)length;
+				return;
+			}
+		}
+		request->error = request->result == -1 ? errno : 0;
+	}
+
+	static void* pool_worker(void* data) {
+		(void)data;
+		uint64_t one = 1;
+		pthread_mutex_lock(&pool.mutex);
+		while (1) {
+			while (!pool.queued) {
+				pool.idle++;
+				pthread_cond_wait(&pool.cond, &pool.mutex);
+				pool.idle--;
+			}
+			pool_request_t* request = pool.queued;
+			pool.queued = request->next;
+			pthread_mutex_unlock(&pool.mutex);
+			pool_run(request);
+			pthread_mutex_lock(&pool.mutex);
+			request->next = pool.completed;
+			pool.completed = request;
+			write(pool.eventfd, &one, sizeof(one));
+		}
+		return NULL;
+	}
+
+	static int pool_fd(lua_State* L) {
+		if (pool.eventfd == -1 && (pool.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+			return luaL_error(L, "can't create eventfd: %s", strerror(errno));
+		return pool.eventfd;
+	}
+
+	// Starts another thread if none are idle and there's room. Threads start with every signal blocked, so that signals
+	// keep going to the loop's signalfd. Returns 0 if there's a thread to run requests, or why one couldn't be started.
+	static int pool_start(void) {
+		int error = 0;
+		pthread_mutex_lock(&pool.mutex);
+		if (pool.idle == 0 && pool.threads < pool.max_threads) {
+			pthread_t thread;
+			pthread_attr_t attr;
+			sigset_t all, previous;
+			sigfillset(&all);
+			pthread_sigmask(SIG_SETMASK, &all, &previous);
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			pthread_attr_setstacksize(&attr, 64*1024);
+			if ((error = pthread_create(&thread, &attr, pool_worker, NULL)) == 0)
+				pool.threads++;
+			pthread_attr_destroy(&attr);
+			pthread_sigmask(SIG_SETMASK, &previous, NULL);
+		}
+		if (pool.threads > 0)
+			error = 0;
+		pthread_mutex_unlock(&pool.mutex);
+		return error;
+	}
+
+	static void pool_submit(pool_request_t* request) {
+		pthread_mutex_lock(&pool.mutex);
+		request->next = NULL;
+		if (pool.queued) pool.last->next = request; else pool.queued = request;
+		pool.last = request;
+		pthread_cond_signal(&pool.cond);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+
+	// Submits `op` on behalf of `promise`, which is resolved by `complete` with what the operation returns: a stream for
+	// `open(path, flags)`, a string, or nothing at the end of the file, for `read(fd, bytes, offset)`, the number of bytes
+	// written for `write(fd, data, offset)`, true for `fsync(fd)`, and a table like `wtk.system.stat`'s for `stat(path)`.
+	// Without an offset, reads and writes happen at the descriptor's position. `op` can also be one of the routines a module
+	// exports for offloading, like `wtk.z.c.offload.gzip`, called with an input string and an integer option, and resolving
+	// with its output. Modules register those routines in the registry's `wtk.c.offload` set, and no other pointer is
+	// accepted. Failures resolve with nil and the error.
+	static int f_pool_submit(lua_State* L) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		pool_op_e op = lua_islightuserdata(L, 2) ? POOL_CALL : luaL_checkoption(L, 2, NULL, pool_ops);
+		pool_fd(L);
+		pool_request_t parsed = { .op = op, .fd = -1, .offset = -1 }, *request = &parsed;
+		switch (op) {
+			case POOL_CALL:
+				luaL_getsubtable(L, LUA_REGISTRYINDEX, "wtk.c.offload");
+				luaL_argcheck(L, lua_rawgetp(L, -1, lua_touserdata(L, 2)) == LUA_TBOOLEAN, 2, "unknown offload routine");
+				lua_pop(L, 2);
+				request->routine = lua_touserdata(L, 2);
+				request->input = luaL_checklstring(L, 3, &request->length);
+				request->option = luaL_optinteger(L, 4, -1);
+			break;
+			case POOL_OPEN:
+				snprintf(request->mode, sizeof(request->mode), "%s", luaL_optstring(L, 4, "rb"));
+				request->flags = file_flags(request->mode) | O_CLOEXEC;
+			// fallthrough
+			case POOL_STAT:
+				request->input = luaL_checkstring(L, 3);
+			break;
+			case POOL_WRITE:
+				request->input = luaL_checklstring(L, 4, &request->length);
+			// fallthrough
+			case POOL_READ:
+				if (op == POOL_READ)
+					request->length = luaL_checkinteger(L, 4);
+				request->offset = luaL_optinteger(L, 5, -1);
+			// fallthrough
+			case POOL_FSYNC:
+				request->fd = luaL_checkinteger(L, 3);
+			break;
+		}
+		int error = pool_start();
+		if (error)
+			return luaL_error(L, "can't start pool thread: %s", strerror(error));
+		// an invalid descriptor is left for the operation to fail on, as it would have.
+		if (parsed.fd != -1 && (parsed.fd = fcntl(parsed.fd, F_DUPFD_CLOEXEC, 0)) == -1 && errno != EBADF)
+			return luaL_error(L, "can't duplicate descriptor: %s", strerror(errno));
+		if (!(request = malloc(sizeof(pool_request_t)))) {
+			if (parsed.fd != -1)
+				close(parsed.fd);
+			return luaL_error(L, "can't allocate pool request");
+		}
+		*request = parsed;
+		lua_createtable(L, 2, 0);
+		lua_pushvalue(L, 1);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, op == POOL_WRITE ? 4 : 3);
+		lua_rawseti(L, -2, 2);
+		luaL_getsubtable(L, LUA_REGISTRYINDEX, "wtk.c.pool");
+		lua_pushvalue(L, -2);
+		lua_rawsetp(L, -2, request);
+		pool_submit(request);
+		lua_pushvalue(L, 1);
+		return 1;
+	}
+
+	static int pool_results(lua_State* L, pool_request_t* request) {
+		if (request->result == -1) {
+			lua_pushnil(L);
+			lua_pushstring(L, request->message ? request->message : strerror(request->error));
+			return 2;
+		}
+		switch (request->op) {
+			case POOL_OPEN: return file_stream(L, request->result, request->mode);
+			case POOL_READ:
+				if (request->result == 0)
+					return 0;
+				lua_pushlstring(L, request->output, request->result);
+			break;
+			case POOL_WRITE: lua_pushinteger(L, request->result); break;
+			case POOL_FSYNC: lua_pushboolean(L, 1); break;
+			case POOL_STAT: system_pushstat(L, &request->stat); break;
+			case POOL_CALL: lua_pushlstring(L, request->output, request->result); break;
+		}
+		return 1;
+	}
+
+	// Resolves the promise of every request that's completed since the last call; what the loop calls when the eventfd is ready.
+	// If resolving one raises, the rest are still resolved, and then the first error is raised.
+	static int f_pool_complete(lua_State* L) {
+		uint64_t count;
+		read(pool_fd(L), &count, sizeof(count));
+		pthread_mutex_lock(&pool.mutex);
+		pool_request_t* request = pool.completed;
+		pool.completed = NULL;
+		pthread_mutex_unlock(&pool.mutex);
+		luaL_getsubtable(L, LUA_REGISTRYINDEX, "wtk.c.pool");
+		int pending = lua_gettop(L), error = 0;
+		while (request) {
+			pool_request_t* next = request->next;
+			lua_rawgetp(L, pending, request);
+			lua_pushnil(L);
+			lua_rawsetp(L, pending, request);
+			lua_rawgeti(L, -1, 1);
+			lua_getfield(L, -1, "resolve");
+			lua_insert(L, -2);
+			int results = pool_results(L, request);
+			if (request->fd != -1)
+				close(request->fd);
+			free(request->output);
+			free(request);
+			if (lua_pcall(L, 1 + results, 0, 0)) {
+				lua_remove(L, -2);
+				if (!error)
+					error = lua_gettop(L);
+				else
+					lua_pop(L, 1);
+			} else
+				lua_pop(L, 1);
+			request = next;
+		}
+		if (error) {
+			lua_pushvalue(L, error);
+			return lua_error(L);
+		}
+		return 0;
+	}
+
+	static int f_pool_fd(lua_State* L) {
+		lua_pushinteger(L, pool_fd(L));
+		return 1;
+	}
+
+	// Sets the most threads the pool will start, and returns the number it has.
+	static int f_pool_threads(lua_State* L) {
+		if (!lua_isnoneornil(L, 1))
+			pool.max_threads = luaL_checkinteger(L, 1);
+		lua_pushinteger(L, pool.threads);
+		return 1;
+	}
+
+	static const luaL_Reg pool_lib[] = {
+		{ "submit",    f_pool_submit   },
+		{ "complete",  f_pool_complete },
+		{ "fd",        f_pool_fd       },
+		{ "threads",   f_pool_threads  },
+		{ NULL,        NULL            }
+	};
+
 #endif
 
 static int f_system_ls(lua_State* L) {
@@ -405,6 +1504,13 @@ static int f_system_realpath(lua_State* L) {
 	return 1;
 }
 
+static void system_pushstat(lua_State* L, struct stat* file) {
+	lua_newtable(L);
+	lua_pushnumber(L, file->st_mtime), lua_setfield(L, -2, "mtime");
+	lua_pushinteger(L, file->st_size), lua_setfield(L, -2, "size");
+	lua_pushstring(L, S_ISREG(file->st_mode) ? "file" : (S_ISDIR(file->st_mode) ? "dir" : "other")), lua_setfield(L, -2, "type");
+}
+
 static int f_system_stat(lua_State* L) {
 	struct stat file;
 	if (stat(luaL_checkstring(L, 1), &file)) {
@@ -412,10 +1518,7 @@ static int f_system_stat(lua_State* L) {
 		lua_pushstring(L, strerror(errno));
 		return 2;
 	}
-	lua_newtable(L);
-	lua_pushnumber(L, file.st_mtime), lua_setfield(L, -2, "mtime");
-	lua_pushinteger(L, file.st_size), lua_setfield(L, -2, "size");
-	lua_pushstring(L, S_ISREG(file.st_mode) ? "file" : (S_ISDIR(file.st_mode) ? "dir" : "other")), lua_setfield(L, -2, "type");
+	system_pushstat(L, &file);
 	return 1;
 }
 
@@ -426,6 +1529,180 @@ static int f_system_time(lua_State* L) {
 	return 1;
 }
 
+// States created with luaW_newstate count every allocation. Optionally, every `sample_interval` bytes allocated is
+// set aside as sampled, for a profiler to attribute to whatever Lua code it next sees running.
+typedef struct {
+	size_t bytes, peak, blocks, allocations, allocated, sampled;
+	long long sample_interval, sample_countdown;
+} luaW_heap_t;
+
+static __thread luaW_heap_t luaW_heap;
+
+#ifdef WTK_POOLED_ALLOC
+	// Small blocks, which is most of what a request allocates (tables, short strings, closures), come from per-thread
+	// freelists, one per 16-byte size class, carved out of 64KB slabs. Lua always tells us the size of the block it's
+	// freeing, so blocks need no header. Slabs are never returned to the system; freed blocks just go back on their list.
+	#define LUAW_POOL_GRANULARITY 16
+	#define LUAW_POOL_CLASSES 16
+	#define LUAW_POOL_SLAB_SIZE (64*1024)
+	typedef struct luaW_pool_block_t { struct luaW_pool_block_t* next; } luaW_pool_block_t;
+	static __thread luaW_pool_block_t* luaW_pool_free[LUAW_POOL_CLASSES];
+	static __thread char* luaW_pool_slab;
+	static __thread size_t luaW_pool_slab_remaining;
+
+	static int luaW_pool_class(size_t size) { return size <= LUAW_POOL_GRANULARITY * LUAW_POOL_CLASSES ? (int)((size + LUAW_POOL_GRANULARITY - 1) / LUAW_POOL_GRANULARITY) - 1 : -1; }
+
+	static void* luaW_pool_alloc(int class) {
+		luaW_pool_block_t* block = luaW_pool_free[class];
+		if (block) {
+			luaW_pool_free[class] = block->next;
+			return block;
+		}
+		size_t size = (class + 1) * LUAW_POOL_GRANULARITY;
+		if (luaW_pool_slab_remaining < size) {
+			// whatever's left of the old slab goes on the freelist for its size, rather than being wasted.
+			if (luaW_pool_slab_remaining > 0) {
+				int remainder = luaW_pool_class(luaW_pool_slab_remaining);
+				((luaW_pool_block_t*)luaW_pool_slab)->next = luaW_pool_free[remainder];
+				luaW_pool_free[remainder] = (luaW_pool_block_t*)luaW_pool_slab;
+			}
+			if (!(luaW_pool_slab = malloc(LUAW_POOL_SLAB_SIZE))) {
+				luaW_pool_slab_remaining = 0;
+				return NULL;
+			}
+			luaW_pool_slab_remaining = LUAW_POOL_SLAB_SIZE;
+		}
+		block = (luaW_pool_block_t*)luaW_pool_slab;
+		luaW_pool_slab += size;
+		luaW_pool_slab_remaining -= size;
+		return block;
+	}
+
+	static void luaW_pool_release(int class, void* ptr) {
+		((luaW_pool_block_t*)ptr)->next = luaW_pool_free[class];
+		luaW_pool_free[class] = ptr;
+	}
+
+	static void* luaW_pool_realloc(void* ptr, size_t osize, size_t nsize) {
+		int old_class = ptr ? luaW_pool_class(osize) : -1, new_class = nsize ? luaW_pool_class(nsize) : -1;
+		if (ptr && old_class == new_class && old_class != -1)
+			return ptr;
+		if (old_class == -1 && new_class == -1) {
+			if (nsize)
+				return realloc(ptr, nsize);
+			free(ptr);
+			return NULL;
+		}
+		void* block = NULL;
+		if (nsize) {
+			block = new_class != -1 ? luaW_pool_alloc(new_class) : malloc(nsize);
+			if (!block)
+				return NULL;
+			if (ptr)
+				memcpy(block, ptr, osize < nsize ? osize : nsize);
+		}
+		if (ptr) {
+			if (old_class != -1)
+				luaW_pool_release(old_class, ptr);
+			else
+				free(ptr);
+		}
+		return block;
+	}
+#else
+	static void* luaW_pool_realloc(void* ptr, size_t osize, size_t nsize) {
+		(void)osize;
+		if (nsize)
+			return realloc(ptr, nsize);
+		free(ptr);
+		return NULL;
+	}
+#endif
+
+void* luaW_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	luaW_heap_t* heap = ud;
+	if (nsize == 0) {
+		if (ptr) {
+			heap->bytes -= osize;
+			heap->blocks--;
+		}
+		return luaW_pool_realloc(ptr, osize, 0);
+	}
+	void* block = luaW_pool_realloc(ptr, ptr ? osize : 0, nsize);
+	if (!block)
+		return NULL;
+	// when ptr is NULL, osize is the type of object being allocated, rather than a size.
+	size_t old = ptr ? osize : 0;
+	heap->bytes += nsize - old;
+	if (heap->bytes > heap->peak)
+		heap->peak = heap->bytes;
+	if (!ptr)
+		heap->blocks++;
+	if (nsize > old) {
+		heap->allocations++;
+		heap->allocated += nsize - old;
+		if (heap->sample_interval && (heap->sample_countdown -= nsize - old) <= 0) {
+			heap->sample_countdown += heap->sample_interval;
+			heap->sampled += heap->sample_interval;
+		}
+	}
+	return block;
+}
+
+static luaW_heap_t* luaW_getheap(lua_State* L) {
+	void* ud;
+	return lua_getallocf(L, &ud) == luaW_alloc ? ud : NULL;
+}
+
+// Starts, or with 0, stops, setting aside sampled bytes; returns 0 if the state isn't counting allocations.
+int luaW_heapsample(lua_State* L, long long interval) {
+	luaW_heap_t* heap = luaW_getheap(L);
+	if (!heap)
+		return 0;
+	heap->sample_interval = heap->sample_countdown = interval;
+	heap->sampled = 0;
+	return 1;
+}
+
+// Returns, and clears, the number of bytes sampled since the last call.
+size_t luaW_heapsampled(lua_State* L) {
+	luaW_heap_t* heap = luaW_getheap(L);
+	if (!heap || !heap->sampled)
+		return 0;
+	size_t sampled = heap->sampled;
+	heap->sampled = 0;
+	return sampled;
+}
+
+static int f_system_heap(lua_State* L) {
+	luaW_heap_t* heap = luaW_getheap(L);
+	if (!heap)
+		return 0;
+	lua_newtable(L);
+	lua_pushinteger(L, heap->bytes); lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, heap->peak); lua_setfield(L, -2, "peak");
+	lua_pushinteger(L, heap->blocks); lua_setfield(L, -2, "blocks");
+	lua_pushinteger(L, heap->allocations); lua_setfield(L, -2, "allocations");
+	lua_pushinteger(L, heap->allocated); lua_setfield(L, -2, "allocated");
+	if (lua_toboolean(L, 1))
+		heap->peak = heap->bytes;
+	return 1;
+}
+
+// The total number of bytes ever allocated; cheap enough to call around every job step.
+static int f_system_allocated(lua_State* L) {
+	luaW_heap_t* heap = luaW_getheap(L);
+	if (!heap)
+		return 0;
+	lua_pushinteger(L, heap->allocated);
+	return 1;
+}
+
+static int f_system_pid(lua_State* L) {
+	lua_pushinteger(L, getpid());
+	return 1;
+}
+
 static int f_system_isatty(lua_State* L){
 	lua_pushboolean(L, isatty(luaL_checkinteger(L, 1)));
 	return 1;
@@ -435,6 +1712,8 @@ static const luaL_Reg io_lib[] = {
 	{ "pipe",      f_pipe_new       },
 	{ "file",      f_file_new       },
 	{ "countdown", f_countdown_new  },
+	{ "watch",     f_watch_new      },
+	{ NULL,        NULL             }
 };
 
 static const luaL_Reg system_lib[] = {
@@ -445,6 +1724,12 @@ static const luaL_Reg system_lib[] = {
 	{ "realpath",  f_system_realpath},
 	{ "time",      f_system_time    },
 	{ "isatty",	  f_system_isatty  },
+	{ "pid",       f_system_pid     },
+	{ "heap",      f_system_heap    },
+	{ "allocated", f_system_allocated },
+	#ifndef _WIN32
+		{ "walk",      f_system_walk    },
+	#endif
 	{ NULL,        NULL }
 };
 
@@ -470,6 +1755,26 @@ int luaopen_wtk_c(lua_State* L) {
 	#ifndef _WIN32
 		luaW_newclass(L, stream);
 		luaW_newclass(L, loop);
+		luaW_newclass(L, watch);
+		luaW_newclass(L, pool);
+		luaL_newmetatable(L, "wtk.c.walk");
+		luaL_setfuncs(L, walk_lib, 0);
+		lua_pop(L, 1);
+		luaL_newmetatable(L, "wtk.c.loop.sentinel");
+		lua_pushcfunction(L, f_loop_sentinel_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pop(L, 1);
+		// coroutines of cancelled jobs, and what they were cancelled with; C functions that yield check it when resumed.
+		lua_getfield(L, -1, "loop");
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "wtk.cancelled");
+		lua_setfield(L, -2, "cancellations");
+		lua_pop(L, 1);
 	#endif
 	luaW_newclass(L, io);
 	lua_getfield(L, -1, "io");
@@ -481,32 +1786,68 @@ int luaopen_wtk_c(lua_State* L) {
 	wtk.Loop = wtk.loop\n\
 	wtk.Stream = wtk.stream\n\
 	wtk.Stream.__index = wtk.Stream\n\
+	local finished, cancellations, stepping = {}, wtk.Loop.cancellations, setmetatable({}, { __mode = 'k' })\n\
+	-- Jobs that wait on the same thing they waited on last time stay registered with the loop, rather than being removed\n\
+	-- and re-added each step. Once a job is finished, its coroutine goes back into the loop's pool for the next job.\n\
+	-- A cancelled job gets one more step to unwind in; if it yields again after that, its coroutine is closed.\n\
 	function wtk.Loop:job_step(job)\n\
-		if coroutine.status(job.co) ~= 'dead' then\n\
-			local status, result = assert(coroutine.resume(job.co, job))\n\
-			if coroutine.status(job.co) ~= 'dead' then\n\
+		if not job.finished then\n\
+			local running, cancelling = self.running, job.cancelled ~= nil\n\
+			self.stepped, self.running = job, job\n\
+			job.step_allocated = wtk.system.allocated()\n\
+			stepping[job.co] = true\n\
+			local status, result = coroutine.resume(job.co, job)\n\
+			stepping[job.co] = nil\n\
+			assert(status, result)\n\
+			if job.step_allocated then job.allocated, job.step_allocated = (job.allocated or 0) + wtk.system.allocated() - job.step_allocated, nil end\n\
+			self.running = running\n\
+			if result == finished or coroutine.status(job.co) == 'dead' then\n\
+				job.finished = true\n\
+				if job.cancelled ~= nil then cancellations[job.co] = nil end\n\
+				if result == finished and #self.coroutines < (self.max_coroutines or 256) then table.insert(self.coroutines, job.co) end\n\
+			elseif cancelling then\n\
+				coroutine.close(job.co)\n\
+				cancellations[job.co], job.finished = nil, true\n\
+				job:reject(wtk.error.new(job.cancelled))\n\
+			else\n\
 				if type(result) == 'number' then \n\
 					result = { time = wtk.io.countdown(result) } \n\
 					result.fd = result.time[0]\n\
 				end\n\
 				local waiting_obj, waiting_type = type(result) == 'table' and (result.socket or result.fd), type(result) == 'table' and result.type or 'read'\n\
-				if (not waiting_obj or not job.waiting) or (job.waiting.obj ~= waiting_obj) or (job.waiting_type ~= waiting_type) then\n\
-					if job.waiting then self:rm(job.waiting.obj) end\n\
-					job.waiting = nil\n\
+				local waiting = job.waiting\n\
+				if waiting and (waiting.obj ~= waiting_obj or waiting.type ~= waiting_type or waiting.edge ~= result.edge) then\n\
+					self:rm(waiting.obj)\n\
+					waiting = nil\n\
 				end\n\
-				job.waiting = waiting_obj and { obj = waiting_obj, type = waiting_type, edge = result.edge, result = result }\n\
-				if job.waiting then \n\
-					self:add(job.waiting.obj, function() self:job_step(job) end, job.waiting.type, job.waiting.edge)\n\
+				job.resume = job.resume or function() self:job_step(job) end\n\
+				if waiting_obj and not waiting then\n\
+					waiting = { obj = waiting_obj, type = waiting_type, edge = result.edge }\n\
+					self:add(waiting_obj, job.resume, waiting_type, waiting.edge, job)\n\
+				end\n\
+				job.waiting = waiting\n\
+				if waiting then\n\
+					waiting.result = result\n\
+				elseif type(result) == 'table' and result.promise then\n\
+					if result.pool and not self.pooled then self.pooled = self:add(wtk.pool.fd(), wtk.pool.complete) end\n\
+					job.schedule = job.schedule or function() self:add(job.resume) end\n\
+					result.promise:always(job.schedule)\n\
 				else\n\
-					self:add(function() self:job_step(job) end)\n\
+					self:add(job.resume)\n\
 				end\n\
 			end\n\
 		end\n\
-		if coroutine.status(job.co) == 'dead' and job.waiting and job.waiting.obj then \n\
+		if job.finished and job.waiting then \n\
 			self:rm(job.waiting.obj)\n\
+			job.waiting = nil\n\
 		end\n\
 		return job\n\
 	end\n\
+	-- Bytes allocated so far by a job, including by the step it's in the middle of; nil unless the state came from luaW_newstate.\n\
+	function wtk.Loop.allocated(job)\n\
+		local now = wtk.system.allocated()\n\
+		if now then return (job.allocated or 0) + (job.step_allocated and now - job.step_allocated or 0) end\n\
+	end\n\
 	function wtk.Stream:write(chunk)\n\
 			local yieldable = coroutine.isyieldable()\n\
 			while #chunk > 0 do\n\
@@ -522,6 +1863,39 @@ int luaopen_wtk_c(lua_State* L) {
 			return self\n\
 	end\n\
 	function wtk.Stream:flush() return self end\n\
+	-- Regular files are always ready as far as epoll is concerned, so from a job, their reads and writes go to the thread\n\
+	-- pool, and only the job waits on the disk. Anywhere else, including other coroutines inside a job, they block.\n\
+	local function pooled(stream, op, arg)\n\
+		local promise = wtk.pool.submit(wtk.Promise.new(), op, stream[op == 'read' and 0 or 1], arg)\n\
+		coroutine.yield({ promise = promise, pool = true })\n\
+		if not promise.resolved then wtk.Loop.check() end\n\
+		return table.unpack(promise.resolved, 1, promise.resolved.n)\n\
+	end\n\
+	local read, write = wtk.Stream.__read, wtk.Stream.__write\n\
+	function wtk.Stream:__read(bytes, blocking)\n\
+		if not self.file or blocking or not self[0] or not stepping[coroutine.running()] then return read(self, bytes, blocking) end\n\
+		local chunk, err = pooled(self, 'read', bytes)\n\
+		if err then error('error reading from stream: ' .. err, 0) end\n\
+		return chunk\n\
+	end\n\
+	function wtk.Stream:__write(chunk, blocking)\n\
+		if not self.file or blocking or not self[1] or not stepping[coroutine.running()] then return write(self, chunk, blocking) end\n\
+		local written, err = pooled(self, 'write', chunk)\n\
+		if not written then return nil, 'error writing to stream: ' .. err end\n\
+		return written\n\
+	end\n\
+	-- Runs a blocking file operation (`open`, `read`, `write`, `fsync` or `stat`) on the thread pool, returning a promise\n\
+	-- that's resolved on this loop with what it returned. See `wtk.pool.submit` for the arguments each takes.\n\
+	function wtk.Loop:submit(op, ...)\n\
+		if not self.pooled then self.pooled = self:add(wtk.pool.fd(), wtk.pool.complete) end\n\
+		return wtk.pool.submit(wtk.Promise.new(), op, ...)\n\
+	end\n\
+	-- Runs a C routine a module exports for the purpose, like `wtk.z.c.offload.gzip`, over the string `input` on the thread\n\
+	-- pool, so that big payloads don't hold up the loop. Returns a promise that resolves with the output, or nil and an error.\n\
+	function wtk.Loop:offload(kind, input, option)\n\
+		assert(type(kind) == 'userdata', 'unknown offload routine')\n\
+		return self:submit(kind, input, option)\n\
+	end\n\
 	function wtk.Stream:print(chunk, ...) return self:write(string.format(chunk .. '\\n', ...)) end\n\
 	function wtk.Stream:yield() coroutine.yield({ fd = self[0] or self[1], type = self[0] and self[1] and 'both' or (self[0] and 'read' or 'write') }) end\n\
 	function wtk.Stream:read(target, nonblocking)\n\
@@ -589,40 +1963,191 @@ int luaopen_wtk_c(lua_State* L) {
 					return table.concat(chunks)\n\
 			end\n\
 	end\n\
-	function wtk.Loop:job(func) return self:job_step(wtk.Promise.new({ co = coroutine.create(function(job) try(function() job:resolve(func(job)) end, function(err) job:reject(err) end) end) })) end\n\
+	local function worker(job)\n\
+		while true do\n\
+			try(function() job:resolve(job.func(job)) end, function(err) job:reject(err) end)\n\
+			job = coroutine.yield(finished)\n\
+		end\n\
+	end\n\
+	function wtk.Loop:job(func) return self:job_step(wtk.Promise.new({ co = table.remove(self.coroutines) or coroutine.create(worker), func = func })) end\n\
+	-- Cancels a job that hasn't finished: whatever it was waiting on is abandoned, and it's stepped once more, so that what\n\
+	-- it was blocked in can raise `reason` (by default, 'cancelled') and let go of what it holds. Unless it finishes of its\n\
+	-- own accord in that step, it's rejected with `reason`. Any groups it made are cancelled along with it.\n\
+	function wtk.Loop:cancel(job, reason)\n\
+		if job.finished or job.resolved or job.rejected or job.cancelled ~= nil then return job end\n\
+		if reason == nil then reason = 'cancelled' end\n\
+		job.cancelled, cancellations[job.co] = reason, reason\n\
+		if job.groups then for group in pairs(job.groups) do group:cancel(reason) end end\n\
+		if coroutine.running() == job.co then error(reason, 0) end\n\
+		if job.waiting then\n\
+			self:rm(job.waiting.obj)\n\
+			job.waiting = nil\n\
+		end\n\
+		job.resume = job.resume or function() self:job_step(job) end\n\
+		self:add(job.resume)\n\
+		return job\n\
+	end\n\
+	-- From inside a job, raises what it was cancelled with, if it was; for long-running work that doesn't otherwise wait on anything.\n\
+	function wtk.Loop.check()\n\
+		local reason = cancellations[coroutine.running()]\n\
+		if reason ~= nil then error(reason, 0) end\n\
+	end\n\
+	-- Calls `func` after `seconds`, unless the function returned is called first.\n\
+	local function after(loop, seconds, func)\n\
+		local timer = wtk.io.countdown(seconds)\n\
+		local function stop() if timer then loop:rm(timer[0]) timer:close() timer = nil end end\n\
+		loop:add(timer[0], function() stop() func() end)\n\
+		return stop\n\
+	end\n\
+	-- Cancels a job with `reason` (by default, 'deadline exceeded') if it hasn't finished within `seconds`.\n\
+	function wtk.Loop:deadline(job, seconds, reason)\n\
+		if not job.finished then job:always(after(self, seconds, function() self:cancel(job, reason == nil and 'deadline exceeded' or reason) end)) end\n\
+		return job\n\
+	end\n\
+	-- Calls `func` with a list of the paths under `path` that changed. Changes are coalesced for `delay` seconds after the\n\
+	-- first (0.05 by default), since saving a file tends to take more than one syscall. With `recursive`, the whole tree is\n\
+	-- watched. Returns the watch, which more paths can be added to, and which `unwatch` stops.\n\
+	function wtk.Loop:watch(path, func, options)\n\
+		local watch, err = wtk.io.watch(path, options)\n\
+		if not watch then return nil, err end\n\
+		local delay, pending, seen = options and options.delay or 0.05, {}, {}\n\
+		local function flush()\n\
+			local paths = pending\n\
+			watch.stop, pending, seen = nil, {}, {}\n\
+			func(paths)\n\
+		end\n\
+		self:add(watch[0], function()\n\
+			for _, changed in ipairs(watch:changes()) do\n\
+				if not seen[changed] then seen[changed], pending[#pending + 1] = true, changed end\n\
+			end\n\
+			if #pending > 0 and not watch.stop then\n\
+				if delay > 0 then watch.stop = after(self, delay, flush) else flush() end\n\
+			end\n\
+		end)\n\
+		return watch\n\
+	end\n\
+	function wtk.Loop:unwatch(watch)\n\
+		if watch.stop then watch.stop() end\n\
+		if watch[0] then self:rm(watch[0]) end\n\
+		watch:close()\n\
+	end\n\
+	-- A set of jobs that stand or fall together: if one of them fails, the group is cancelled, or its deadline passes,\n\
+	-- the rest are cancelled. A group made from inside a job is cancelled along with that job.\n\
+	wtk.Loop.Group = {}\n\
+	wtk.Loop.Group.__index = wtk.Loop.Group\n\
+	function wtk.Loop:group(options)\n\
+		local group = setmetatable({ loop = self, jobs = {}, pending = 0, parent = self.running }, wtk.Loop.Group)\n\
+		if group.parent then\n\
+			group.parent.groups = group.parent.groups or {}\n\
+			group.parent.groups[group] = true\n\
+		end\n\
+		if options and options.deadline then group.stop = after(self, options.deadline, function() group:cancel(options.reason == nil and 'deadline exceeded' or options.reason) end) end\n\
+		return group\n\
+	end\n\
+	-- Starts a job in the group, optionally with its own deadline.\n\
+	function wtk.Loop.Group:job(func, deadline)\n\
+		local job = self.loop:job(func)\n\
+		self.jobs[#self.jobs + 1], self.pending = job, self.pending + 1\n\
+		job:on(function() self:settled() end, function(err) self:settled() self:cancel(err) end)\n\
+		if self.cancelled ~= nil then self.loop:cancel(job, self.cancelled) elseif deadline then self.loop:deadline(job, deadline) end\n\
+		return job\n\
+	end\n\
+	function wtk.Loop.Group:settled()\n\
+		self.pending = self.pending - 1\n\
+		if self.pending == 0 and self.parent and self.parent.groups then self.parent.groups[self] = nil end\n\
+	end\n\
+	function wtk.Loop.Group:cancel(reason)\n\
+		if self.cancelled ~= nil then return self end\n\
+		if reason == nil then reason = 'cancelled' end\n\
+		self.cancelled = reason\n\
+		if self.stop then self.stop() end\n\
+		for _, job in ipairs(self.jobs) do self.loop:cancel(job, reason) end\n\
+		return self\n\
+	end\n\
+	-- Waits for every job in the group, returning a list of the first value each resolved with, or raising the first failure.\n\
+	function wtk.Loop.Group:await()\n\
+		local status, results = pcall(wtk.Promise.await, wtk.Promise.all(self.jobs))\n\
+		if self.stop then self.stop() end\n\
+		if self.parent and self.parent.groups then self.parent.groups[self] = nil end\n\
+		if not status then error(results, 0) end\n\
+		return results\n\
+	end\n\
+	-- Waits for a promise, or a list of them, returning the first value each resolved with. The job is put back on the\n\
+	-- loop's deferred queue once they've all resolved; no fds are involved.\n\
 	function wtk.Loop:await(t)\n\
-		if type(t) ~= 'table' or #t == 0 then t = { t } end\n\
-		local signal = wtk.io.pipe()\n\
-		local status, result\n\
-		local prom = wtk.Promise.all(t):done(function(t) status, result = true, t end):fail(function(t) status, result = false, t end):always(function() signal:write('1') end)\n\
-		if status == nil then coroutine.yield({ fd = signal[0] }) end\n\
-		if not status then error(result) end\n\
-		return result\n\
+		if type(t) ~= 'table' or getmetatable(t) == wtk.Promise then t = { t } end\n\
+		return wtk.Promise.all(t):await()\n\
 	end\n\
 	wtk.Promise = {}\n\
 	setmetatable({}, wtk.Promise)\n\
 	wtk.Promise.__index = wtk.Promise\n\
-	function wtk.Promise.new(hash) local self = setmetatable({ resolved = nil, rejected = nil, doneh = {}, failh = {} }, wtk.Promise) for k,v in pairs(hash or {}) do self[k] = v end return self end\n\
-	function wtk.Promise:on(done, fail) if self.resolved and done then done(table.unpack(self.resolved)) end if self.rejected and fail then fail(table.unpack(self.rejected)) end table.insert(self.doneh, done) table.insert(self.failh, fail) return self end\n\
+	function wtk.Promise.new(hash) local self = setmetatable({}, wtk.Promise) for k,v in pairs(hash or {}) do self[k] = v end return self end\n\
+	-- A promise settles once; handlers added afterwards are called straight away.\n\
+	function wtk.Promise:on(done, fail)\n\
+		if self.resolved then\n\
+			if done then done(table.unpack(self.resolved, 1, self.resolved.n)) end\n\
+		elseif self.rejected then\n\
+			if fail then fail(table.unpack(self.rejected, 1, self.rejected.n)) end\n\
+		else\n\
+			if done then self.doneh = self.doneh or {} self.doneh[#self.doneh + 1] = done end\n\
+			if fail then self.failh = self.failh or {} self.failh[#self.failh + 1] = fail end\n\
+		end\n\
+		return self\n\
+	end\n\
 	function wtk.Promise:done(func) return self:on(func) end\n\
 	function wtk.Promise:fail(func) return self:on(nil, func) end\n\
 	function wtk.Promise:always(func) return self:on(func, func) end\n\
-	function wtk.Promise:resolve(...) self.resolved = { ... } for k,v in ipairs(self.doneh) do v(table.unpack(self.resolved)) end return self end\n\
-	function wtk.Promise:reject(...) self.rejected = { ... } for k,v in ipairs(self.failh) do v(table.unpack(self.rejected)) end return self end\n\
-	function wtk.Promise.all(promises, func)\n\
-		local res, fail, total = {}, false, 0\n\
-		local prom = wtk.Promise.new()\n\
+	function wtk.Promise:settle(key, handlers, ...)\n\
+		if self.resolved or self.rejected then return self end\n\
+		self[key], self.doneh, self.failh = table.pack(...), nil, nil\n\
+		if handlers then for i = 1, #handlers do handlers[i](...) end end\n\
+		return self\n\
+	end\n\
+	function wtk.Promise:resolve(...) return self:settle('resolved', self.doneh, ...) end\n\
+	function wtk.Promise:reject(...) return self:settle('rejected', self.failh, ...) end\n\
+	-- From inside a job, suspends it until the promise settles, then returns what it resolved with, or raises what it was rejected with.\n\
+	function wtk.Promise:await()\n\
+		if not self.resolved and not self.rejected then\n\
+			coroutine.yield({ promise = self })\n\
+			if not self.resolved and not self.rejected then wtk.Loop.check() end\n\
+		end\n\
+		if self.rejected then error(self.rejected[1], 0) end\n\
+		return table.unpack(self.resolved, 1, self.resolved.n)\n\
+	end\n\
+	-- Resolves with a list of the first value each promise resolved with, or rejects as soon as any of them does.\n\
+	function wtk.Promise.all(promises)\n\
+		local prom, results, remaining = wtk.Promise.new(), {}, #promises\n\
+		if remaining == 0 then return prom:resolve(results) end\n\
+		local function reject(...) prom:reject(...) end\n\
 		for i, promise in ipairs(promises) do\n\
-			promise:done(function(r) \n\
-				total = total + 1\n\
-				res[i] = r \n\
-				if total == #promises then \n\
-					prom:resolve(res) \n\
-				end\n\
-			end):fail(function(r) prom:reject(r) end)\n\
+			promise:on(function(r)\n\
+				results[i], remaining = r, remaining - 1\n\
+				if remaining == 0 then prom:resolve(results) end\n\
+			end, reject)\n\
+		end\n\
+		return prom\n\
+	end\n\
+	-- Resolves as soon as any promise does; rejects with a list of the first value each was rejected with, if they all are.\n\
+	function wtk.Promise.any(promises)\n\
+		local prom, errors, remaining = wtk.Promise.new(), {}, #promises\n\
+		if remaining == 0 then return prom:reject(errors) end\n\
+		local function resolve(...) prom:resolve(...) end\n\
+		for i, promise in ipairs(promises) do\n\
+			promise:on(resolve, function(err)\n\
+				errors[i], remaining = err, remaining - 1\n\
+				if remaining == 0 then prom:reject(errors) end\n\
+			end)\n\
 		end\n\
 		return prom\n\
 	end\n\
+	-- Settles the same way as whichever promise settles first.\n\
+	function wtk.Promise.race(promises)\n\
+		local prom = wtk.Promise.new()\n\
+		local function resolve(...) prom:resolve(...) end\n\
+		local function reject(...) prom:reject(...) end\n\
+		for _, promise in ipairs(promises) do promise:on(resolve, reject) end\n\
+		return prom\n\
+	end\n\
 	wtk.error = {\n\
 		__tostring = function(self) return tostring(self.error or self.stack) end,\n\
 		new = function(err, level)\n\
@@ -722,23 +2247,167 @@ int luaopen_wtk_c(lua_State* L) {
 	return 1;
 }
 
+// A read-only window onto memory that outlives the state, like the data packed into the binary, or that's kept alive by
+// the view itself; nothing is copied until it's converted to a string, or part of it is taken with `sub`. Views can carry
+// a table of attributes, which are looked up after their methods.
+#ifndef LUAW_VIEW_T
+	#define LUAW_VIEW_T
+	typedef struct { const char* data; size_t length; } luaW_view_t;
+#endif
+
+static int f_view_index(lua_State* L) {
+	luaL_checkudata(L, 1, "wtk.c.view");
+	if (luaL_getmetafield(L, 1, luaL_checkstring(L, 2)) != LUA_TNIL)
+		return 1;
+	if (lua_getiuservalue(L, 1, 1) != LUA_TTABLE)
+		return 0;
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int f_view_len(lua_State* L) {
+	lua_pushinteger(L, ((luaW_view_t*)luaL_checkudata(L, 1, "wtk.c.view"))->length);
+	return 1;
+}
+
+static int f_view_tostring(lua_State* L) {
+	luaW_view_t* view = luaL_checkudata(L, 1, "wtk.c.view");
+	lua_pushlstring(L, view->data, view->length);
+	return 1;
+}
+
+// Concatenating a view copies it out, as if it were a string.
+static int f_view_concat(lua_State* L) {
+	for (int i = 1; i <= 2; ++i) {
+		luaW_view_t* view = luaL_testudata(L, i, "wtk.c.view");
+		if (view)
+			lua_pushlstring(L, view->data, view->length);
+		else if (lua_type(L, i) == LUA_TSTRING || lua_type(L, i) == LUA_TNUMBER)
+			lua_pushvalue(L, i);
+		else
+			return luaL_error(L, "attempt to concatenate a %s value", luaL_typename(L, i));
+	}
+	lua_concat(L, 2);
+	return 1;
+}
+
+static luaW_view_t* view_range(lua_State* L, lua_Integer* start, lua_Integer* end) {
+	luaW_view_t* view = luaL_checkudata(L, 1, "wtk.c.view");
+	lua_Integer length = view->length;
+	*start = luaL_optinteger(L, 2, 1), *end = luaL_optinteger(L, 3, -1);
+	if (*start < 0) *start = *start < -length ? 1 : length + *start + 1; else if (*start == 0) *start = 1;
+	if (*end < 0) *end = length + *end + 1; else if (*end > length) *end = length;
+	if (*start > *end) *start = 1, *end = 0;
+	return view;
+}
+
+// Works like string.sub.
+static int f_view_sub(lua_State* L) {
+	lua_Integer start, end;
+	luaW_view_t* view = view_range(L, &start, &end);
+	lua_pushlstring(L, &view->data[start - 1], end - start + 1);
+	return 1;
+}
+
+// Like `sub`, but returns a view onto that part, which keeps whatever this view keeps alive.
+static int f_view_slice(lua_State* L) {
+	lua_Integer start, end;
+	luaW_view_t* view = view_range(L, &start, &end);
+	luaW_view_t* slice = lua_newuserdatauv(L, sizeof(luaW_view_t), 2);
+	slice->data = &view->data[start - 1];
+	slice->length = end - start + 1;
+	lua_getiuservalue(L, 1, 2);
+	lua_setiuservalue(L, -2, 2);
+	luaL_setmetatable(L, "wtk.c.view");
+	return 1;
+}
+
+static const luaL_Reg view_lib[] = {
+	{ "__len",      f_view_len      },
+	{ "__tostring", f_view_tostring },
+	{ "__concat",   f_view_concat   },
+	{ "__index",    f_view_index    },
+	{ "sub",        f_view_sub      },
+	{ "slice",      f_view_slice    },
+	{ NULL,         NULL            }
+};
+
+// Pushes a view onto `data`. If `owner` isn't 0, the value at that index is what `data` belongs to, and is kept alive
+// along with the view.
+void luaW_newview(lua_State* L, const char* data, size_t length, int owner) {
+	owner = owner ? lua_absindex(L, owner) : 0;
+	luaW_view_t* view = lua_newuserdatauv(L, sizeof(luaW_view_t), 2);
+	view->data = data;
+	view->length = length;
+	if (owner) {
+		lua_pushvalue(L, owner);
+		lua_setiuservalue(L, -2, 2);
+	}
+	if (luaL_newmetatable(L, "wtk.c.view"))
+		luaL_setfuncs(L, view_lib, 0);
+	lua_setmetatable(L, -2);
+}
+
+// Each packed file is an entry of LUAW_PACKED_STRIDE pointers: its name, its type ("lua" or "file", with "+deflate" if
+// it's compressed), its data and length, and for files, a quoted ETag, and a gzipped copy and its length, if there is one.
+#define LUAW_PACKED_STRIDE 7
+
 #ifdef WTK_MAKE_PACKER
 	// used to pack files into a single C file
-	// usage: [ ! -f packer ] && $CC ../../src/wtk.c -DMAKE_PACKER -o packer -lm && ./packer *.lua > packed.c
+	// usage: [ ! -f packer ] && $CC ../../src/wtk.c -DMAKE_PACKER -o packer -lm && ./packer [options] *.lua > packed.c
+	// `--strip` strips debug information from modules. `--deflate` compresses everything, to be inflated the first time
+	// it's used, and `--gzip` adds a gzipped copy of every other file, for serving. Both require wtk.z.c to be included.
+	// `--incbin=file` writes the data to `file`, and has the assembler include it, rather than the compiler parse it.
+	int luaopen_wtk_z_c(lua_State* L) __attribute__((weak));
 	int main(int argc, char* argv[]) {
 		lua_State* L = luaL_newstate();
 		luaL_openlibs(L);
+		if (luaopen_wtk_z_c) {
+			luaL_requiref(L, "wtk.z.c", luaopen_wtk_z_c, 0);
+			lua_pop(L, 1);
+		}
 		if (luaW_loadblock(L, __FILE__, __LINE__, "\n\
-			print('#define WTK_PACKED\\nconst char* luaW_packed[] = {') \n\
-			for i,file in ipairs({ ... }) do \n\
+			local options, files = {}, {}\n\
+			for _, arg in ipairs({ ... }) do\n\
+				local option, value = arg:match('^%-%-([%w-]+)=?(.*)')\n\
+				if option then options[option] = value ~= '' and value or true else files[#files + 1] = arg end\n\
+			end\n\
+			local has_z, z = pcall(require, 'wtk.z.c')\n\
+			assert(has_z or not (options.deflate or options.gzip), '--deflate and --gzip need wtk.z.c to be included')\n\
+			local function compress(type, data) local stream = z:open(type, { level = 9 }) return stream:send(data) .. stream:close() end\n\
+			local function fnv1a(data)\n\
+				local hash = -3750763034362895579\n\
+				for i = 1, #data do hash = (hash ~ data:byte(i)) * 1099511628211 end\n\
+				return string.format('%016x', hash)\n\
+			end\n\
+			local blob, offset = {}, 0\n\
+			local function emit(data)\n\
+				if options.incbin then\n\
+					blob[#blob + 1], offset = data, offset + #data\n\
+					return 'luaW_packed_blob+' .. (offset - #data)\n\
+				end\n\
+				return '\\\"' .. data:gsub('.',function(c) return string.format('\\\\x%02X',string.byte(c)) end) .. '\\\"'\n\
+			end\n\
+			local entries = {}\n\
+			for i,file in ipairs(files) do \n\
 				local package, cont = file:gsub('/', '.'):gsub('.*wtk', 'wtk'):gsub('%.lua$', '')\n\
 				local type = file:find('%.lua$') and 'lua' or 'file'\n\
 				io.stderr:write('Packing ' .. file .. ' (' .. package .. ')...\\n')\n\
 				cont = assert(io.open(file, 'rb'), 'Cannot find file ' .. file):read('*all')\n\
-				if type == 'lua' then cont = string.dump(assert(load(cont, '='..package))) end\n\
-				cont = cont:gsub('.',function(c) return string.format('\\\\x%02X',string.byte(c)) end) \n\
-				print('\t\\\"'..file:gsub('/', '.'):gsub('.*wtk', 'wtk'):gsub('%.lua$', '') ..'\\\",\\\"'..type..'\\\",\\\"'..cont..'\\\",(void*)'..math.floor(#cont/4)..',')\n\
+				local etag, gzip = type == 'file' and '\\\"\\\\\\\"' .. fnv1a(cont) .. '\\\\\\\"\\\"' or '(void*)0', type == 'file' and options.gzip and compress('gzip', cont)\n\
+				if type == 'lua' then cont = string.dump(assert(load(cont, '='..package)), options.strip and true) end\n\
+				if options.deflate then cont, type = compress('deflate', cont), type .. '+deflate' end\n\
+				entries[#entries + 1] = '\\t\\\"'..package..'\\\",\\\"'..type..'\\\",'..emit(cont)..',(void*)'..#cont..','..etag..','..(gzip and emit(gzip) or '(void*)0')..',(void*)'..(gzip and #gzip or 0)..','\n\
 			end\n\
+			print('#define WTK_PACKED')\n\
+			if options.incbin then\n\
+				assert(io.open(options.incbin, 'wb')):write(table.concat(blob)):close()\n\
+				print('__asm__(\\\".pushsection .rodata\\\\n.balign 16\\\\nluaW_packed_blob:\\\\n.incbin \\\\\\\"' .. options.incbin .. '\\\\\\\"\\\\n.popsection\\\");')\n\
+				print('extern const char luaW_packed_blob[];')\n\
+			end\n\
+			print('const char* luaW_packed[] = {')\n\
+			print(table.concat(entries, '\\n'))\n\
 			print(\"(void*)0, (void*)0, (void*)0\\n};\")")
 		) {
 			fprintf(stderr, "Error loading packer: %s\n", lua_tostring(L, -1));
@@ -756,26 +2425,183 @@ int luaopen_wtk_c(lua_State* L) {
 	#define main main_
 #else
 	#include <packed.lua.c>
+	#ifndef WTK_UNPACKED
+		// Packed entry `i`'s data. If it was packed with --deflate, it's inflated with wtk.z.c into a string, which is left
+		// on the stack.
+		static const char* luaW_packeddata(lua_State* L, int i, size_t* length) {
+			*length = (size_t)luaW_packed[i+3];
+			if (!strstr(luaW_packed[i+1], "+deflate"))
+				return luaW_packed[i+2];
+			if (lua_getfield(L, LUA_REGISTRYINDEX, "wtk.c.inflate") == LUA_TNIL) {
+				lua_pop(L, 1);
+				if (luaW_loadblock(L, __FILE__, __LINE__, "local z = require('wtk.z.c')\n\
+					return function(data) local stream = z:open('inflate') return assert(stream:send(data)) .. assert(stream:close()) end"))
+					lua_error(L);
+				lua_call(L, 0, 1);
+				lua_pushvalue(L, -1);
+				lua_setfield(L, LUA_REGISTRYINDEX, "wtk.c.inflate");
+			}
+			lua_pushlstring(L, luaW_packed[i+2], *length);
+			lua_call(L, 1, 1);
+			return lua_tolstring(L, -1, length);
+		}
+
+		// The preload entry for a packed module; it isn't loaded until it's first required.
+		static int luaW_packedloader(lua_State* L) {
+			int i = lua_tointeger(L, lua_upvalueindex(1)), arguments = lua_gettop(L);
+			size_t length;
+			const char* data = luaW_packeddata(L, i, &length);
+			if (luaL_loadbuffer(L, data, length, luaW_packed[i]))
+				return luaL_error(L, "error loading %s: %s", luaW_packed[i], lua_tostring(L, -1));
+			if (data != luaW_packed[i+2])
+				lua_remove(L, -2);
+			lua_insert(L, 1);
+			lua_call(L, arguments, LUA_MULTRET);
+			return lua_gettop(L);
+		}
+
+		// A view onto packed file `i`, with its quoted `etag`, and if it was packed with --gzip, `gzip`, a view onto its
+		// gzipped copy. `owner` is the index of the string holding its data, if it had to be inflated.
+		static void luaW_packedview(lua_State* L, int i, const char* data, size_t length, int owner) {
+			luaW_newview(L, data, length, owner);
+			lua_createtable(L, 0, 2);
+			if (luaW_packed[i+4]) {
+				lua_pushstring(L, luaW_packed[i+4]);
+				lua_setfield(L, -2, "etag");
+			}
+			if (luaW_packed[i+5]) {
+				luaW_newview(L, luaW_packed[i+5], (size_t)luaW_packed[i+6], 0);
+				lua_setfield(L, -2, "gzip");
+			}
+			lua_setiuservalue(L, -2, 1);
+		}
+
+		// Files packed with --deflate are inflated the first time they're looked up in `packed`.
+		static int luaW_packedindex(lua_State* L) {
+			lua_pushvalue(L, 2);
+			if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNUMBER)
+				return 0;
+			int i = lua_tointeger(L, -1);
+			size_t length;
+			const char* data = luaW_packeddata(L, i, &length);
+			luaW_packedview(L, i, data, length, -1);
+			lua_pushvalue(L, 2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, 1);
+			lua_pushvalue(L, 2);
+			lua_pushnil(L);
+			lua_rawset(L, lua_upvalueindex(1));
+			return 1;
+		}
+	#endif
+
+	#ifndef _WIN32
+		static int luaW_cachewriter(lua_State* L, const void* data, size_t length, void* file) {
+			(void)L;
+			return fwrite(data, 1, length, file) != length;
+		}
+
+		// `loadfile`, except that bytecode is kept in the directory in upvalue 1, under a hash of the file's real path, size,
+		// modification time and the Lua release, so that a file is only parsed again once it changes.
+		static int luaW_cachedloadfile(lua_State* L) {
+			const char* path = luaL_optstring(L, 1, NULL);
+			const char* mode = luaL_optstring(L, 2, "bt");
+			int env = !lua_isnone(L, 3) ? 3 : 0, status = -1;
+			char real[PATH_MAX], key[PATH_MAX + 128], cache[PATH_MAX];
+			struct stat st;
+			if (path && strchr(mode, 'b') && strchr(mode, 't') && stat(path, &st) == 0 && realpath(path, real)) {
+				unsigned long long hash = 14695981039346656037ULL;
+				int length = snprintf(key, sizeof(key), "%s\n%lld\n%lld.%09ld\n%s", real, (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, LUA_RELEASE);
+				for (int i = 0; i < length; ++i)
+					hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+				snprintf(cache, sizeof(cache), "%s/%016llx.luac", lua_tostring(L, lua_upvalueindex(1)), hash);
+				if ((status = luaL_loadfilex(L, cache, "b")) != LUA_OK) {
+					lua_pop(L, 1);
+					if ((status = luaL_loadfilex(L, path, mode)) == LUA_OK) {
+						snprintf(key, sizeof(key), "%s.%d", cache, getpid());
+						FILE* file = fopen(key, "wb");
+						if (file) {
+							int failed = lua_dump(L, luaW_cachewriter, file, 0);
+							if (fclose(file) || failed || rename(key, cache))
+								unlink(key);
+						}
+					}
+				}
+			}
+			if (status == -1)
+				status = luaL_loadfilex(L, path, mode);
+			if (status != LUA_OK) {
+				luaL_pushfail(L);
+				lua_insert(L, -2);
+				return 2;
+			}
+			if (env) {
+				lua_pushvalue(L, env);
+				if (!lua_setupvalue(L, -2, 1))
+					lua_pop(L, 1);
+			}
+			return 1;
+		}
+
+		// If `WTK_BYTECODE_CACHE` names a directory, modules that are required from disk, the entry point and hot reloads
+		// all go through a `loadfile` that caches bytecode there.
+		static int luaW_bytecodecache(lua_State* L) {
+			const char* directory = getenv("WTK_BYTECODE_CACHE");
+			if (!directory || !*directory)
+				return 0;
+			mkdir(directory, 0700);
+			lua_pushstring(L, directory);
+			lua_pushcclosure(L, luaW_cachedloadfile, 1);
+			if (luaW_loadblock(L, __FILE__, __LINE__, "local loadfile = ...\n\
+				_G.loadfile = loadfile\n\
+				package.searchers[2] = function(name)\n\
+					local path, err = package.searchpath(name, package.path)\n\
+					if not path then return err end\n\
+					local loader, err = loadfile(path)\n\
+					if not loader then error(string.format(\"error loading module '%s' from file '%s':\\n\\t%s\", name, path, err), 0) end\n\
+					return loader, path\n\
+				end"))
+				return -1;
+			lua_insert(L, -2);
+			return lua_pcall(L, 1, 0, 0);
+		}
+	#endif
+
+	// Modules are put into `package.preload`, and loaded the first time they're required; other files are put into the
+	// global `packed`, as views onto the binary's own copy. Lua loaded from disk can be cached as bytecode; see above.
 	int luaW_packlua(lua_State* L, const char* directory) {
+		#ifndef _WIN32
+			if (luaW_bytecodecache(L))
+				return -1;
+		#endif
 		#ifndef WTK_UNPACKED
 			lua_newtable(L);
 			lua_pushvalue(L, -1);
 			lua_setglobal(L, "packed");
+			int packed = lua_gettop(L);
+			lua_newtable(L);
 			lua_getfield(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
-			for (int i = 0; luaW_packed[i]; i += 4) {
+			for (int i = 0; luaW_packed[i]; i += LUAW_PACKED_STRIDE) {
 				lua_pushstring(L, (strncmp(luaW_packed[i], directory, strlen(directory)) == 0) ? &luaW_packed[i][strlen(directory)+1] : luaW_packed[i]);
-				if (strcmp(luaW_packed[i+1], "lua") == 0)  {
-					if (luaL_loadbuffer(L, luaW_packed[i+2], (size_t)luaW_packed[i+3], luaW_packed[i])) {
-						lua_pushfstring(L, "error loading %s: %s", luaW_packed[i], lua_tostring(L, -1));
-						return -1;
-					}
-					lua_rawset(L, -3);
+				if (strncmp(luaW_packed[i+1], "lua", 3) == 0)  {
+					lua_pushinteger(L, i);
+					lua_pushcclosure(L, luaW_packedloader, 1);
+					lua_rawset(L, packed + 2);
+				} else if (strcmp(luaW_packed[i+1], "file") == 0) {
+					luaW_packedview(L, i, luaW_packed[i+2], (size_t)luaW_packed[i+3], 0);
+					lua_rawset(L, packed);
 				} else {
-					lua_pushlstring(L, luaW_packed[i+2], (size_t)luaW_packed[i+3]);
-					lua_rawset(L, -4);
+					lua_pushinteger(L, i);
+					lua_rawset(L, packed + 1);
 				}
 			}
-			lua_pop(L, 2);
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 1);
+			lua_insert(L, -2);
+			lua_pushcclosure(L, luaW_packedindex, 1);
+			lua_setfield(L, -2, "__index");
+			lua_setmetatable(L, packed);
+			lua_pop(L, 1);
 		#else
 			#pragma message "Using unpacked lua modules."
 			lua_getglobal(L, "package");
@@ -794,6 +2620,20 @@ int luaopen_wtk_c(lua_State* L) {
 
 #define luaW_loadentry(L, init) luaW_loadblock(L, "luaW_loadentry", 1, "(package.preload." init " or assert(loadfile(assert(package.searchpath(\"" init "\", package.path)))))(...)")
 
+static int luaW_panic(lua_State* L) {
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;
+}
+
+// A drop-in replacement for luaL_newstate that counts allocations, which are then available from `wtk.system.heap()`.
+// Counts are kept per thread.
+lua_State* luaW_newstate() {
+	lua_State* L = lua_newstate(luaW_alloc, &luaW_heap);
+	if (L)
+		lua_atpanic(L, luaW_panic);
+	return L;
+}
+
 int luaW_run(lua_State* L, int argc, char* argv[]) {
 	for (int i = 1; i < argc; ++i) 
 		lua_pushstring(L, argv[i]);
@@ -9418,7 +9418,8 @@ static int mz_stat64(const char *path, struct __stat64 *buffer)
 typedef enum {
     Z_CLOSED,
     Z_DEFLATE,
-    Z_INFLATE
+    Z_INFLATE,
+    Z_GZIP
 } z_type_e;
 
 typedef int (*f_comp_op_t)(mz_stream*, int);
@@ -9426,6 +9427,9 @@ typedef int (*f_comp_op_t)(mz_stream*, int);
 typedef struct {
     mz_stream stream;
     z_type_e type;
+    mz_ulong crc;
+    mz_ulong total;
+    int header_written;
     int buffer_length;
     int buffer_capacity;
     char buffer[];
@@ -9434,6 +9438,24 @@ typedef struct {
 static int z_imin(int a, int b) { return a < b ? a : b; }
 static int z_imax(int a, int b) { return a > b ? a : b; }
 
+// gzip is a raw deflate stream, wrapped in a minimal header, and a trailer with the crc32 and size of the input.
+static void z_gzip_header(z_t* z, luaL_Buffer* buffer) {
+    static const char header[] = { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03 };
+    if (z->type == Z_GZIP && !z->header_written) {
+        luaL_addlstring(buffer, header, sizeof(header));
+        z->header_written = 1;
+    }
+}
+
+static void z_gzip_trailer(z_t* z, luaL_Buffer* buffer) {
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; ++i) {
+        trailer[i] = (z->crc >> (i * 8)) & 0xFF;
+        trailer[i + 4] = (z->total >> (i * 8)) & 0xFF;
+    }
+    luaL_addlstring(buffer, (const char*)trailer, sizeof(trailer));
+}
+
 static int f_z_send(lua_State* L) {
     z_t* z = (z_t*)lua_touserdata(L, 1);
     size_t packet_length;
@@ -9444,10 +9466,16 @@ static int f_z_send(lua_State* L) {
     luaL_Buffer buffer;
     luaL_buffinit(L, &buffer);
     size_t current_offset = offset;
-    f_comp_op_t mz_comp = z->type == Z_DEFLATE ? mz_deflate : mz_inflate;
+    f_comp_op_t mz_comp = z->type == Z_INFLATE ? mz_inflate : mz_deflate;
     char compression_buffer[z->buffer_capacity];
     int remaining_length = length;
-    while (remaining_length > 0) {
+    if (z->type == Z_GZIP) {
+        z->crc = mz_crc32(z->crc, (const unsigned char*)&packet[offset], length);
+        z->total += length;
+        z_gzip_header(z, &buffer);
+    }
+    int output_full = 1;
+    while (remaining_length > 0 || output_full || z->buffer_length > 0) {
         int remaining_capacity = z->buffer_capacity - z->buffer_length;
         int packet_processed = z_imin(remaining_capacity, remaining_length);
         memcpy(&z->buffer[z->buffer_length], &packet[current_offset], packet_processed);
@@ -9465,13 +9493,15 @@ static int f_z_send(lua_State* L) {
             return 2;
         }
         int size = z->buffer_capacity - z->stream.avail_out;
+        int consumed = z->buffer_length - z->stream.avail_in;
         if (z->stream.avail_in)
             memmove(z->buffer, z->stream.next_in, z->stream.avail_in);
         z->buffer_length = z->stream.avail_in;
         if (size > 0)
             luaL_addlstring(&buffer, compression_buffer, size);
-        else
+        else if (consumed == 0)
             break;
+        output_full = size == z->buffer_capacity;
     }
     luaL_pushresult(&buffer);
     return 1;
@@ -9500,6 +9530,10 @@ static int f_z_open(lua_State* L) {
     if (strcmp(type, "deflate") == 0) {
         mz_deflateInit(&z->stream, level);
         z->type = Z_DEFLATE;
+    } else if (strcmp(type, "gzip") == 0) {
+        mz_deflateInit2(&z->stream, level, MZ_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY);
+        z->type = Z_GZIP;
+        z->crc = MZ_CRC32_INIT;
     } else if (strcmp(type, "inflate") == 0) {
         mz_inflateInit(&z->stream);
         z->type = Z_INFLATE;
@@ -9513,10 +9547,11 @@ static int f_z_flush(lua_State* L) {
     if (z->type == Z_CLOSED)
         return 0;
     int err = MZ_OK;
-    f_comp_op_t mz_comp = z->type == Z_DEFLATE ? mz_deflate : mz_inflate;
+    f_comp_op_t mz_comp = z->type == Z_INFLATE ? mz_inflate : mz_deflate;
     char compression_buffer[z->buffer_capacity];
     luaL_Buffer buffer;
     luaL_buffinit(L, &buffer);
+    z_gzip_header(z, &buffer);
     while (err != MZ_STREAM_END) {
         z->stream.next_in = z->buffer;
         z->stream.avail_in = z->buffer_length;
@@ -9531,7 +9566,12 @@ static int f_z_flush(lua_State* L) {
         int size = z->buffer_capacity - z->stream.avail_out;
         if (size > 0)
             luaL_addlstring(&buffer, compression_buffer, size);
+        if (z->stream.avail_in)
+            memmove(z->buffer, z->stream.next_in, z->stream.avail_in);
+        z->buffer_length = z->stream.avail_in;
     }
+    if (z->type == Z_GZIP)
+        z_gzip_trailer(z, &buffer);
     luaL_pushresult(&buffer);
     return 1;
 }
@@ -9539,7 +9579,7 @@ static int f_z_flush(lua_State* L) {
 static int f_z_close(lua_State* L) {
     z_t* z = (z_t*)lua_touserdata(L, 1);
     f_z_flush(L);
-    if (z->type == Z_DEFLATE)
+    if (z->type == Z_DEFLATE || z->type == Z_GZIP)
         mz_deflateEnd(&z->stream);
     else if (z->type == Z_INFLATE)
         mz_inflateEnd(&z->stream);
@@ -9547,6 +9587,89 @@ static int f_z_close(lua_State* L) {
     return 1;
 }
 
+#ifndef LUAW_OFFLOAD_T
+    #define LUAW_OFFLOAD_T
+    // CPU-heavy work that wtk's thread pool can run; see `wtk.Loop:offload`.
+    typedef const char* (*luaW_offload_f)(const char* input, size_t length, int option, char** output, size_t* output_length);
+    typedef struct { const char* name; luaW_offload_f run; } luaW_offload_t;
+#endif
+
+// The whole of `input`, in one go, into a malloc'd buffer. Runs on a pool thread, so touches nothing but its arguments.
+static const char* z_offload(z_type_e type, const char* input, size_t length, int level, char** output, size_t* output_length) {
+    static const char header[] = { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03 };
+    mz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int err = type == Z_INFLATE ? mz_inflateInit(&stream) : (type == Z_GZIP ? 
+        mz_deflateInit2(&stream, level, MZ_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY) : mz_deflateInit(&stream, level));
+    if (err != MZ_OK)
+        return mz_error(err);
+    size_t capacity = (type == Z_INFLATE ? length * 4 : mz_deflateBound(&stream, length)) + sizeof(header) + 8 + 1024, size = 0;
+    char* buffer = malloc(capacity);
+    const char* error = NULL;
+    if (!buffer) {
+        if (type == Z_INFLATE) mz_inflateEnd(&stream); else mz_deflateEnd(&stream);
+        return "out of memory";
+    }
+    if (type == Z_GZIP) {
+        memcpy(buffer, header, sizeof(header));
+        size = sizeof(header);
+    }
+    stream.next_in = (const unsigned char*)input;
+    stream.avail_in = length;
+    while (1) {
+        if (capacity - size < 1024) {
+            char* grown = realloc(buffer, capacity * 2);
+            if (!grown) {
+                error = "out of memory";
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        stream.next_out = (unsigned char*)&buffer[size];
+        stream.avail_out = capacity - size;
+        err = type == Z_INFLATE ? mz_inflate(&stream, MZ_SYNC_FLUSH) : mz_deflate(&stream, MZ_FINISH);
+        size = capacity - stream.avail_out;
+        if (err == MZ_STREAM_END)
+            break;
+        if (err != MZ_OK && (err != MZ_BUF_ERROR || stream.avail_out > 0)) {
+            error = mz_error(err);
+            break;
+        }
+        if (stream.avail_in == 0 && stream.avail_out > 0) {
+            error = "truncated stream";
+            break;
+        }
+    }
+    if (type == Z_INFLATE) mz_inflateEnd(&stream); else mz_deflateEnd(&stream);
+    if (error) {
+        free(buffer);
+        return error;
+    }
+    if (type == Z_GZIP) {
+        mz_ulong crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char*)input, length);
+        for (int i = 0; i < 4; ++i) {
+            buffer[size + i] = (crc >> (i * 8)) & 0xFF;
+            buffer[size + i + 4] = (length >> (i * 8)) & 0xFF;
+        }
+        size += 8;
+    }
+    *output = buffer;
+    *output_length = size;
+    return NULL;
+}
+
+static const char* z_offload_deflate(const char* input, size_t length, int level, char** output, size_t* output_length) { return z_offload(Z_DEFLATE, input, length, level, output, output_length); }
+static const char* z_offload_inflate(const char* input, size_t length, int level, char** output, size_t* output_length) { return z_offload(Z_INFLATE, input, length, level, output, output_length); }
+static const char* z_offload_gzip(const char* input, size_t length, int level, char** output, size_t* output_length) { return z_offload(Z_GZIP, input, length, level, output, output_length); }
+
+static const luaW_offload_t z_offloads[] = {
+    { "deflate",   z_offload_deflate },
+    { "inflate",   z_offload_inflate },
+    { "gzip",      z_offload_gzip    },
+    { NULL,        NULL              }
+};
+
 static const luaL_Reg f_z_api[] = {
     { "open",      f_z_open         },
     { "send",      f_z_send         },
@@ -9561,6 +9684,18 @@ int luaopen_wtk_z_c(lua_State* L) {
     luaL_setfuncs(L, f_z_api, 0);
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
+    // routines are registered in `wtk.c.offload`; the pool won't run anything else.
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "wtk.c.offload");
+    lua_newtable(L);
+    for (int i = 0; z_offloads[i].name; ++i) {
+        lua_pushlightuserdata(L, (void*)&z_offloads[i]);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, -4);
+        lua_pushlightuserdata(L, (void*)&z_offloads[i]);
+        lua_setfield(L, -2, z_offloads[i].name);
+    }
+    lua_setfield(L, -3, "offload");
+    lua_pop(L, 1);
     const char* lua_z_code = "local z = ...\n\
     function z.compress(op, packet, options)\n\
         local self = z:open(op, options)\n\
@@ -9586,6 +9721,7 @@ int luaopen_wtk_z_c(lua_State* L) {
     end\n\
     function z.deflate(packet, options) return z.compress('deflate', packet, options or {}) end\n\
     function z.inflate(packet, options) return z.compress('inflate', packet, options or {}) end\n\
+    function z.gzip(packet, options) return z.compress('gzip', packet, options or {}) end\n\
     return z";
     if (luaL_loadstring(L, lua_z_code))
         return lua_error(L);